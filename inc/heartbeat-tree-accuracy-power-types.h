@@ -12,13 +12,33 @@ extern "C" {
 
 #include <stdio.h>
 #include <stdint.h>
-#ifdef HEARTBEAT_USE_PTHREADS_LOCK
+#include <sys/types.h>
 #include <pthread.h>
+
+#ifndef HEARTBEAT_CACHE_LINE_SIZE
+  #define HEARTBEAT_CACHE_LINE_SIZE 64
+#endif
+#define HEARTBEAT_CACHE_ALIGNED __attribute__((aligned(HEARTBEAT_CACHE_LINE_SIZE)))
+
+// time resolutions kept by hb_add_rollup()
+#ifndef HEARTBEAT_ROLLUP_TIERS_MAX
+  #define HEARTBEAT_ROLLUP_TIERS_MAX 4
+#endif
+
+// phase boundaries kept by the change-point detector
+#ifndef HEARTBEAT_PHASES_MAX
+  #define HEARTBEAT_PHASES_MAX 16
 #endif
 
 // function that returns an energy value in microjoules
 typedef long long (_hb_get_energy_func) (void*);
 
+// additional energy sources (package, core, DRAM, ...) beyond the primary one
+#ifndef HEARTBEAT_ENERGY_DOMAINS_MAX
+  #define HEARTBEAT_ENERGY_DOMAINS_MAX 4
+#endif
+#define HEARTBEAT_ENERGY_DOMAIN_NAME_MAX 16
+
 typedef struct {
   int64_t last_timestamp;
   int64_t total_time;
@@ -30,15 +50,77 @@ typedef struct {
   uint64_t window_work;
 } _heartbeat_work_data;
 
+typedef struct {
+  // start of the open span, -1 if none
+  int64_t begin;
+  // span time since the last record, and the number of spans it covers
+  int64_t active;
+  uint64_t spans;
+  int64_t total_active;
+  int64_t window_active;
+} _heartbeat_span_data;
+
+typedef struct {
+  int flags;
+  int64_t last_cpu_time;
+  int64_t total_cpu_time;
+  int64_t window_cpu_time;
+  uint64_t last_vcsw;
+  uint64_t last_ivcsw;
+} _heartbeat_cpu_data;
+
+typedef struct {
+  uint64_t interval;
+  int64_t period;
+  double budget;
+  uint64_t min_interval;
+  int64_t last_time;
+  uint64_t pending;
+  // without the tick clock, period is checked when (pending & check_mask) == 0
+  uint64_t check_mask;
+  // heartbeats credited to the last record
+  uint64_t beats;
+  uint64_t pending_work;
+  double pending_accuracy;
+} _heartbeat_sampling_data;
+
+typedef struct {
+  char* log_name;
+  uint64_t max_bytes;
+  int64_t max_age;
+  unsigned int segments;
+  int compress;
+  int64_t open_time;
+  uint64_t bytes;
+  pid_t compress_pid;
+} _heartbeat_log_rotation_data;
+
 typedef struct {
   double total_accuracy;
   double window_accuracy;
 } _heartbeat_accuracy_data;
 
+typedef struct {
+  char name[HEARTBEAT_ENERGY_DOMAIN_NAME_MAX];
+  _hb_get_energy_func* ef;
+  void* ref_arg;
+} _heartbeat_energy_domain;
+
 typedef struct {
   double last_energy;
+  // timestamp of the heartbeat before the counter was last seen to change,
+  // so the latest step accumulated no earlier than this
+  int64_t last_change;
   double total_energy;
   double window_energy;
+  // counter range (0 if unknown) and max plausible power, in J and W
+  double range;
+  double max_power;
+  double domain_range[HEARTBEAT_ENERGY_DOMAINS_MAX];
+  double domain_last_energy[HEARTBEAT_ENERGY_DOMAINS_MAX];
+  int64_t domain_last_change[HEARTBEAT_ENERGY_DOMAINS_MAX];
+  double domain_total_energy[HEARTBEAT_ENERGY_DOMAINS_MAX];
+  double domain_window_energy[HEARTBEAT_ENERGY_DOMAINS_MAX];
 } _heartbeat_energy_data;
 
 typedef struct {
@@ -50,12 +132,19 @@ typedef struct {
   uint64_t shared_id;
   uint64_t user_tag;
   uint64_t timestamp;
+  // index of the predecessor latency was measured from, -1 if none
+  int64_t critical;
 
   uint64_t work;
   int64_t latency;
+  // time spent in heartbeat_begin()/heartbeat_end() spans, else latency
+  int64_t active;
   double global_perf;
   double window_perf;
   double instant_perf;
+  double global_active_perf;
+  double window_active_perf;
+  double instant_active_perf;
 
   double accuracy;
   double global_acc;
@@ -66,48 +155,256 @@ typedef struct {
   double global_pwr;
   double window_pwr;
   double instant_pwr;
+  double global_epw;
+  double window_epw;
+  double instant_epw;
+  double global_edp;
+  double window_edp;
+  double instant_edp;
+
+  double domain_energy[HEARTBEAT_ENERGY_DOMAINS_MAX];
+  double domain_global_pwr[HEARTBEAT_ENERGY_DOMAINS_MAX];
+  double domain_window_pwr[HEARTBEAT_ENERGY_DOMAINS_MAX];
+
+  int64_t cpu_time;
+  uint64_t vcsw;
+  uint64_t ivcsw;
+  double global_cpu;
+  double window_cpu;
+  double instant_cpu;
 } _heartbeat_record_t;
 
 typedef struct {
+  // counts of samples that were corrected or rejected
+  uint64_t time_steps;
+  uint64_t energy_wraps;
+  uint64_t energy_outliers;
+} _heartbeat_correction_data;
+
+typedef struct {
+  int enabled;
+  double min_rate;
+  double max_rate;
+  double power_cap;
+  double knob;
+  double knob_min;
+  double knob_max;
+  double pole;
+  uint64_t window_count;
+  // Kalman filter estimate of rate per knob unit
+  double speed;
+  double speed_var;
+} _heartbeat_control_data;
+
+typedef struct {
+  // start of the bucket's interval, 0 if the bucket is empty
+  int64_t start;
+  uint64_t count;
+  uint64_t work;
+  int64_t time;
+  double accuracy;
+  double energy;
+  int64_t min_latency;
+  int64_t max_latency;
+} _heartbeat_rollup_t;
+
+typedef struct {
+  int64_t interval;
+  uint64_t size;
+  _heartbeat_rollup_t* buckets;
+} _heartbeat_rollup_tier;
+
+typedef struct {
+  unsigned int count;
+  _heartbeat_rollup_tier tiers[HEARTBEAT_ROLLUP_TIERS_MAX];
+} _heartbeat_rollup_data;
+
+typedef struct {
+  // baseline learned at the start of each phase
+  uint64_t n;
+  double mean;
+  double m2;
+  // cumulative standardized deviations above and below the baseline, and
+  // the beats where they last started to grow
+  double pos;
+  double neg;
+  uint64_t pos_id;
+  uint64_t neg_id;
+} _heartbeat_cusum;
+
+typedef struct {
+  int enabled;
+  int changed;
+  double threshold;
+  double drift;
+  uint64_t min_beats;
+  _heartbeat_cusum perf;
+  _heartbeat_cusum pwr;
+  uint64_t count;
+  uint64_t boundaries[HEARTBEAT_PHASES_MAX];
+} _heartbeat_phase_data;
+
+typedef struct {
+  // up to two runs of records in the log buffer, oldest first
+  const _heartbeat_record_t* records[2];
+  uint64_t count[2];
+  // generation checked by hb_check_history_view()
+  uint64_t seq;
+} _heartbeat_history_view;
+
+typedef struct {
+  uint64_t count;
+  double sum;
+  double min;
+  double max;
+  double mean;
+  double variance;
+} _heartbeat_field_stats;
+
+struct _heartbeat_t;
+
+// function called with HEARTBEAT_EVENT_* flags and the record that raised them
+typedef void (_hb_event_func) (struct _heartbeat_t*, int, const _heartbeat_record_t*, void*);
+
+typedef struct {
+  int enabled;
+  int state;
+  double min;
+  double max;
+} _heartbeat_bounds;
+
+typedef struct {
+  int events;
+  _heartbeat_record_t record;
+} _heartbeat_event;
+
+typedef struct {
+  int enabled;
+  int delivery;
+  _hb_event_func* func;
+  void* arg;
+  uint64_t window_count;
+  _heartbeat_bounds perf;
+  _heartbeat_bounds acc;
+  _heartbeat_bounds pwr;
+
+  // queue for deferred delivery, head is written by the producer
+  _heartbeat_event* queue;
+  uint64_t queue_size;
+  uint64_t head;
+  uint64_t dropped;
+  int fd;
+  int running;
+  pthread_t thread;
+  // written by the consumer
+  HEARTBEAT_CACHE_ALIGNED uint64_t tail;
+} _heartbeat_event_data;
+
+/*
+ * Written by every heartbeat in the tree, so it's kept on its own cache
+ * line(s) to avoid false sharing with anything else.
+ */
+typedef struct HEARTBEAT_CACHE_ALIGNED {
   char valid;
   uint64_t counter;
 #ifdef HEARTBEAT_USE_PTHREADS_LOCK
   pthread_mutex_t mutex;
 #endif
+  // set when in a named shared memory segment
+  char pshared;
+  uint32_t ready;
 
   // data
   _heartbeat_time_data td;
 } _heartbeat_shared_data;
 
+/*
+ * A record's contributions to the window totals, kept in a ring of
+ * window_size entries apart from the log buffer so the two can be sized
+ * independently.
+ */
 typedef struct {
-  char valid;
-  uint64_t counter;
-  _hb_get_energy_func* ef;
-  void* ref_arg;
+  int64_t latency;
+  int64_t active;
+  uint64_t work;
+  int64_t cpu_time;
+  double accuracy;
+  double energy;
+  double domain_energy[HEARTBEAT_ENERGY_DOMAINS_MAX];
+} _heartbeat_window_entry;
 
-  // data
-  _heartbeat_time_data td;
-  _heartbeat_work_data wd;
-  _heartbeat_accuracy_data ad;
-  _heartbeat_energy_data ed;
+typedef struct {
+  /*
+   * Fields are grouped by who writes and reads them, each group on its own
+   * cache line(s), so that readers polling the published state and cold
+   * configuration reads don't contend with the producer's running values.
+   */
 
-  // logging
+  // configuration - read-mostly
+  _hb_get_energy_func* ef;
+  void* ref_arg;
+  unsigned int domain_count;
+  _heartbeat_energy_domain domains[HEARTBEAT_ENERGY_DOMAINS_MAX];
   FILE* text_file;
+  // records are rendered here and written to text_file's descriptor
+  char* text_buf;
+  _heartbeat_log_rotation_data lr;
   _heartbeat_record_t* log;
   uint64_t buffer_depth;
+  _heartbeat_window_entry* window;
+  // state file kept up to date on every record, see hb_set_state_file()
+  void* state_map;
+  uint64_t state_size;
+  // compressed history, see hb_set_compressed_history()
+  struct _heartbeat_history* hs;
+
+  // published state - written by the producer, polled by readers
+  // seq is odd while the producer is updating, see hb_get_history()
+  HEARTBEAT_CACHE_ALIGNED uint64_t seq;
+  uint64_t counter;
   uint64_t buffer_index;
   uint64_t read_index;
+  // id of the oldest valid record, nonzero after hb_restore_state()
+  uint64_t first_id;
+
+  // running values - written by the producer
+  HEARTBEAT_CACHE_ALIGNED char valid;
+  // slot in window of the next record
+  uint64_t window_index;
+  _heartbeat_time_data td;
+  _heartbeat_work_data wd;
+  _heartbeat_span_data sn;
+  _heartbeat_cpu_data cd;
+  _heartbeat_sampling_data sp;
+  _heartbeat_accuracy_data ad;
+  _heartbeat_energy_data ed;
+  _heartbeat_correction_data cr;
+  _heartbeat_control_data ct;
+  _heartbeat_rollup_data ru;
+  _heartbeat_phase_data ph;
+  _heartbeat_event_data ev;
 } _heartbeat_local_data;
 
+/*
+ * Heartbeats are allocated on cache line boundaries so that heartbeats
+ * driven by different threads never share a line.
+ */
 typedef struct _heartbeat_t {
   struct _heartbeat_t* parent;
   uint64_t window_size;
   _heartbeat_shared_data* sd;
+  // set if sd is in a named shared memory segment, see hb_attach_shared()
+  char* shm_name;
+  int shm_fd;
   _heartbeat_local_data ld;
 } _heartbeat_t;
 
 typedef _heartbeat_t heartbeat_t;
 typedef _heartbeat_record_t heartbeat_record_t;
+typedef _heartbeat_rollup_t heartbeat_rollup_t;
+typedef _heartbeat_history_view heartbeat_history_view_t;
+typedef _heartbeat_field_stats heartbeat_field_stats_t;
+typedef _hb_event_func hb_event_func;
 typedef _hb_get_energy_func hb_get_energy_func;
 
 #ifdef __cplusplus
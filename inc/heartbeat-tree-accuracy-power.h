@@ -15,6 +15,11 @@ extern "C" {
 #include "heartbeat-tree-accuracy.h"
 #include <stdint.h>
 
+/* Event flags passed to hb_event_func */
+#define HEARTBEAT_EVENT_PWR_LOW    0x080
+#define HEARTBEAT_EVENT_PWR_HIGH   0x100
+#define HEARTBEAT_EVENT_PWR_NORMAL 0x200
+
 /**
  * Initialize a heartbeats instance.
  *
@@ -33,6 +38,132 @@ heartbeat_t* heartbeat_acc_pow_init(heartbeat_t* parent,
                                     hb_get_energy_func* read_energy_func,
                                     void* ref_arg);
 
+/**
+ * Initialize a heartbeats instance attached to named shared memory, see
+ * heartbeat_init_shared().
+ *
+ * @param shm_name
+ * @param window_size
+ * @param buffer_depth
+ * @param log_name
+ * @param read_energy_func
+ * @param ref_arg
+ * @return heartbeat_t or NULL on failure
+ */
+heartbeat_t* heartbeat_acc_pow_init_shared(const char* shm_name,
+                                           uint64_t window_size,
+                                           uint64_t buffer_depth,
+                                           const char* log_name,
+                                           hb_get_energy_func* read_energy_func,
+                                           void* ref_arg);
+
+/**
+ * Register an additional named energy source (e.g. "dram"), read in the same
+ * pass as the primary energy function on every recorded heartbeat and
+ * tracked separately. Up to HEARTBEAT_ENERGY_DOMAINS_MAX domains may be
+ * added; do so before heartbeats are issued.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param name the domain name, truncated to HEARTBEAT_ENERGY_DOMAIN_NAME_MAX
+ * @param read_energy_func returns the domain energy in microjoules
+ * @param ref_arg passed to read_energy_func
+ * @return the domain index, or -1 on failure
+ */
+int hb_add_energy_domain(heartbeat_t* hb,
+                         const char* name,
+                         hb_get_energy_func* read_energy_func,
+                         void* ref_arg);
+
+/**
+ * Get the number of energy domains registered with hb_add_energy_domain().
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the domain count
+ */
+unsigned int hb_get_energy_domain_count(const heartbeat_t* hb);
+
+/**
+ * Get the name of an energy domain.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param domain the domain index
+ * @return the name, or NULL if domain is out of range
+ */
+const char* hb_get_energy_domain_name(const heartbeat_t* hb,
+                                      unsigned int domain);
+
+/**
+ * Set the range of the primary energy counter so that wraparound can be
+ * corrected, e.g. from a RAPL zone's max_energy_range_uj. With no range set,
+ * a decreasing counter is treated as a reset and its delta is dropped.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param range the counter range in microjoules, or 0 if unknown
+ */
+void hb_set_energy_range(heartbeat_t* hb, double range);
+
+/**
+ * Set the counter range of an energy domain, see hb_set_energy_range().
+ *
+ * @param hb pointer to heartbeat_t
+ * @param domain the domain index
+ * @param range the counter range in microjoules, or 0 if unknown
+ * @return 0 on success, -1 if domain is out of range
+ */
+int hb_set_energy_domain_range(heartbeat_t* hb,
+                               unsigned int domain,
+                               double range);
+
+/**
+ * Set the maximum plausible power for all energy sources. Deltas implying
+ * more power than this are rejected as outliers and replaced by an estimate
+ * at the current window power. A delta is judged over the time since the
+ * counter last changed rather than the heartbeat's latency, so counters that
+ * update less often than heartbeats arrive (e.g. RAPL) aren't rejected.
+ * Heartbeats with a latency of 0 are not checked.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param max_power the power limit, or 0 for none
+ */
+void hb_set_max_power(heartbeat_t* hb, double max_power);
+
+/**
+ * Returns the number of energy counter wraparounds corrected so far.
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the wraparound count (uint64_t)
+ */
+uint64_t hb_get_energy_wraps(const heartbeat_t* hb);
+
+/**
+ * Returns the number of energy deltas rejected so far as counter resets or
+ * as exceeding the max power.
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the outlier count (uint64_t)
+ */
+uint64_t hb_get_energy_outliers(const heartbeat_t* hb);
+
+/**
+ * Set the window power bounds that raise HEARTBEAT_EVENT_PWR_* events.
+ * Use -INFINITY or INFINITY to leave a side unbounded.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param min the minimum window power
+ * @param max the maximum window power
+ */
+void hb_set_power_bounds(heartbeat_t* hb, double min, double max);
+
+/**
+ * Cap the window power for the built-in controller (see hb_set_controller()).
+ * The recommended knob is limited to what the cap allows, assuming power is
+ * proportional to the knob, even if that misses the target rate.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param cap the power cap, or 0 for none
+ */
+void hb_set_power_cap(heartbeat_t* hb, double cap);
+
 /**
  * Get the total energy for the life of this heartbeat.
  *
@@ -74,6 +205,93 @@ double hb_get_window_power(const heartbeat_t* hb);
  */
 double hb_get_instant_power(const heartbeat_t* hb);
 
+/**
+ * Returns the energy per unit of work over the life of the entire application.
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the energy per work (double)
+ */
+double hb_get_global_energy_per_work(const heartbeat_t* hb);
+
+/**
+ * Returns the energy per unit of work over the last window.
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the energy per work (double)
+ */
+double hb_get_window_energy_per_work(const heartbeat_t* hb);
+
+/**
+ * Returns the energy per unit of work for the last heartbeat.
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the energy per work (double)
+ */
+double hb_get_instant_energy_per_work(const heartbeat_t* hb);
+
+/**
+ * Returns the energy-delay product per unit of work over the life of the entire application, i.e. the energy
+ * per work times the time per work.
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the energy-delay product (double)
+ */
+double hb_get_global_edp(const heartbeat_t* hb);
+
+/**
+ * Returns the energy-delay product per unit of work over the last window, i.e. the energy
+ * per work times the time per work.
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the energy-delay product (double)
+ */
+double hb_get_window_edp(const heartbeat_t* hb);
+
+/**
+ * Returns the energy-delay product per unit of work for the last heartbeat, i.e. the energy
+ * per work times the time per work.
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the energy-delay product (double)
+ */
+double hb_get_instant_edp(const heartbeat_t* hb);
+
+/**
+ * Get the total energy of a domain for the life of this heartbeat.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param domain the domain index
+ * @return the total energy (double), 0 if domain is out of range
+ */
+double hb_get_global_domain_energy(const heartbeat_t* hb, unsigned int domain);
+
+/**
+ * Get the current window energy of a domain.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param domain the domain index
+ * @return the window energy (double), 0 if domain is out of range
+ */
+double hb_get_window_domain_energy(const heartbeat_t* hb, unsigned int domain);
+
+/**
+ * Returns the power of a domain over the life of the entire application.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param domain the domain index
+ * @return the power (double), 0 if domain is out of range
+ */
+double hb_get_global_domain_power(const heartbeat_t* hb, unsigned int domain);
+
+/**
+ * Returns the power of a domain over the last window.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param domain the domain index
+ * @return the power (double), 0 if domain is out of range
+ */
+double hb_get_window_domain_power(const heartbeat_t* hb, unsigned int domain);
+
 /**
  * Returns the energy recorded in this record.
  *
@@ -106,6 +324,99 @@ double hbr_get_window_power(const heartbeat_record_t* hbr);
  */
 double hbr_get_instant_power(const heartbeat_record_t* hbr);
 
+/**
+ * Returns the global energy per work recorded in this record.
+ *
+ * @param hbr
+ * @return the global energy per work (double)
+ */
+double hbr_get_global_energy_per_work(const heartbeat_record_t* hbr);
+
+/**
+ * Returns the window energy per work recorded in this record.
+ *
+ * @param hbr
+ * @return the window energy per work (double)
+ */
+double hbr_get_window_energy_per_work(const heartbeat_record_t* hbr);
+
+/**
+ * Returns the instant energy per work recorded in this record.
+ *
+ * @param hbr
+ * @return the instant energy per work (double)
+ */
+double hbr_get_instant_energy_per_work(const heartbeat_record_t* hbr);
+
+/**
+ * Returns the global energy-delay product recorded in this record.
+ *
+ * @param hbr
+ * @return the global energy-delay product (double)
+ */
+double hbr_get_global_edp(const heartbeat_record_t* hbr);
+
+/**
+ * Returns the window energy-delay product recorded in this record.
+ *
+ * @param hbr
+ * @return the window energy-delay product (double)
+ */
+double hbr_get_window_edp(const heartbeat_record_t* hbr);
+
+/**
+ * Returns the instant energy-delay product recorded in this record.
+ *
+ * @param hbr
+ * @return the instant energy-delay product (double)
+ */
+double hbr_get_instant_edp(const heartbeat_record_t* hbr);
+
+/**
+ * Returns the energy of a domain recorded in this record.
+ *
+ * @param hbr
+ * @param domain the domain index, < HEARTBEAT_ENERGY_DOMAINS_MAX
+ * @return the energy (double)
+ */
+double hbr_get_domain_energy(const heartbeat_record_t* hbr, unsigned int domain);
+
+/**
+ * Returns the global power of a domain recorded in this record.
+ *
+ * @param hbr
+ * @param domain the domain index, < HEARTBEAT_ENERGY_DOMAINS_MAX
+ * @return the global power (double)
+ */
+double hbr_get_global_domain_power(const heartbeat_record_t* hbr,
+                                   unsigned int domain);
+
+/**
+ * Returns the window power of a domain recorded in this record.
+ *
+ * @param hbr
+ * @param domain the domain index, < HEARTBEAT_ENERGY_DOMAINS_MAX
+ * @return the window power (double)
+ */
+double hbr_get_window_domain_power(const heartbeat_record_t* hbr,
+                                   unsigned int domain);
+
+/**
+ * Returns the energy used in a rollup bucket.
+ *
+ * @param hbru pointer to heartbeat_rollup_t
+ * @return the energy (double)
+ */
+double hbru_get_energy(const heartbeat_rollup_t* hbru);
+
+/**
+ * Returns the power over a rollup bucket's heartbeats.
+ *
+ * @param hbru pointer to heartbeat_rollup_t
+ * @return the power (double)
+ */
+double hbru_get_power(const heartbeat_rollup_t* hbru);
+
 #ifdef __cplusplus
 }
 #endif
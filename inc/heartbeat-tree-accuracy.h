@@ -14,6 +14,11 @@ extern "C" {
 #include "heartbeat-tree-accuracy-types.h"
 #include "heartbeat-tree.h"
 
+/* Event flags passed to hb_event_func */
+#define HEARTBEAT_EVENT_ACC_LOW    0x010
+#define HEARTBEAT_EVENT_ACC_HIGH   0x020
+#define HEARTBEAT_EVENT_ACC_NORMAL 0x040
+
 /**
  * Initialize a heartbeats instance.
  *
@@ -28,6 +33,21 @@ heartbeat_t* heartbeat_acc_init(heartbeat_t* parent,
                                 uint64_t buffer_depth,
                                 const char* log_name);
 
+/**
+ * Initialize a heartbeats instance attached to named shared memory, see
+ * heartbeat_init_shared().
+ *
+ * @param shm_name
+ * @param window_size
+ * @param buffer_depth
+ * @param log_name
+ * @return heartbeat_t or NULL on failure
+ */
+heartbeat_t* heartbeat_acc_init_shared(const char* shm_name,
+                                       uint64_t window_size,
+                                       uint64_t buffer_depth,
+                                       const char* log_name);
+
 /**
  * Registers a heartbeat
  *
@@ -44,6 +64,70 @@ int64_t heartbeat_acc(heartbeat_t* hb,
                       double accuracy,
                       const heartbeat_t* hb_prev);
 
+/**
+ * Registers heartbeats for a set of heartbeats at once, see
+ * heartbeat_group().
+ *
+ * @param hbs the heartbeats, in the order their records are written
+ * @param n the number of heartbeats
+ * @param user_tag
+ * @param work the work for each heartbeat
+ * @param accuracy the accuracy for each heartbeat
+ * @param hb_prevs the predecessor for each heartbeat, or NULL for none;
+ *        entries may be NULL
+ * @return timestamp
+ */
+int64_t heartbeat_acc_group(heartbeat_t* const* hbs,
+                            unsigned int n,
+                            uint64_t user_tag,
+                            const uint64_t* work,
+                            const double* accuracy,
+                            const heartbeat_t* const* hb_prevs);
+
+/**
+ * Close the span started by heartbeat_begin() and register a heartbeat.
+ *
+ * @param hb
+ * @param user_tag
+ * @param work
+ * @param accuracy
+ * @return timestamp
+ */
+int64_t heartbeat_acc_end(heartbeat_t* hb,
+                          uint64_t user_tag,
+                          uint64_t work,
+                          double accuracy);
+
+/**
+ * Registers a heartbeat with several predecessors, see heartbeat_join().
+ *
+ * @param hb
+ * @param user_tag
+ * @param work
+ * @param accuracy
+ * @param hb_prevs the predecessors, entries may be NULL
+ * @param nprevs the number of predecessors
+ * @param policy one of HEARTBEAT_PREV_LATEST, _EARLIEST, or _ALL
+ * @return timestamp
+ */
+int64_t heartbeat_acc_join(heartbeat_t* hb,
+                           uint64_t user_tag,
+                           uint64_t work,
+                           double accuracy,
+                           const heartbeat_t* const* hb_prevs,
+                           unsigned int nprevs,
+                           int policy);
+
+/**
+ * Set the window accuracy bounds that raise HEARTBEAT_EVENT_ACC_* events.
+ * Use -INFINITY or INFINITY to leave a side unbounded.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param min the minimum window accuracy
+ * @param max the maximum window accuracy
+ */
+void hb_set_accuracy_bounds(heartbeat_t* hb, double min, double max);
+
 /**
  * Get the total accuracy for the life of this heartbeat.
  *
@@ -117,6 +201,14 @@ double hbr_get_window_accuracy(const heartbeat_record_t* hbr);
  */
 double hbr_get_instant_accuracy(const heartbeat_record_t* hbr);
 
+/**
+ * Returns the accuracy accumulated in a rollup bucket.
+ *
+ * @param hbru pointer to heartbeat_rollup_t
+ * @return the accuracy (double)
+ */
+double hbru_get_accuracy(const heartbeat_rollup_t* hbru);
+
 #ifdef __cplusplus
 }
 #endif
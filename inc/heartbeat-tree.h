@@ -15,11 +15,41 @@ extern "C" {
 #include "heartbeat-tree-types.h"
 #include <stdint.h>
 
+/* Flags for hb_set_cpu_stats() */
+#define HEARTBEAT_CPU_TIME         0x1
+#define HEARTBEAT_CPU_CTX_SWITCHES 0x2
+
+/* Event flags passed to hb_event_func */
+#define HEARTBEAT_EVENT_WINDOW      0x001
+#define HEARTBEAT_EVENT_PERF_LOW    0x002
+#define HEARTBEAT_EVENT_PERF_HIGH   0x004
+#define HEARTBEAT_EVENT_PERF_NORMAL 0x008
+#define HEARTBEAT_EVENT_PHASE       0x400
+
+/* Policies for choosing the predecessor in heartbeat_join() */
+#define HEARTBEAT_PREV_LATEST   0
+#define HEARTBEAT_PREV_EARLIEST 1
+#define HEARTBEAT_PREV_ALL      2
+
+/* Field types for hb_get_field_stats() */
+#define HEARTBEAT_FIELD_DOUBLE 0
+#define HEARTBEAT_FIELD_INT64  1
+#define HEARTBEAT_FIELD_UINT64 2
+
+/* Event delivery modes for hb_set_event_handler() */
+#define HEARTBEAT_EVENT_INLINE   0
+#define HEARTBEAT_EVENT_DEFERRED 1
+#define HEARTBEAT_EVENT_NOTIFY   2
+
 /**
  * Initialize a heartbeats instance.
+ * The window and the log buffer are sized independently: buffer_depth is the
+ * number of records kept for history and flushed to log_name at a time. A
+ * depth of 0 is treated as 1, keeping only the latest record (flushed every
+ * heartbeat if logging).
  *
  * @param parent
- * @param window_size
+ * @param window_size must be > 0
  * @param buffer_depth
  * @param log_name
  * @return heartbeat_t or NULL on failure
@@ -43,6 +73,81 @@ int64_t heartbeat(heartbeat_t* hb,
                   uint64_t work,
                   const heartbeat_t* hb_prev);
 
+/**
+ * Registers a heartbeat that depends on several predecessors (e.g. a stage
+ * joining the output of two producers). The heartbeat's latency is measured
+ * from one of them, chosen by policy, and its index in hb_prevs is kept in
+ * the record (see hbr_get_critical_prev()):
+ *
+ * HEARTBEAT_PREV_LATEST - the last predecessor to beat, which the stage
+ * was waiting on.
+ * HEARTBEAT_PREV_EARLIEST - the first predecessor to beat since this
+ * heartbeat's previous beat, so latency includes waiting for the others.
+ * HEARTBEAT_PREV_ALL - the last predecessor to beat, but only if all of
+ * them have beaten since this heartbeat's previous beat.
+ *
+ * Predecessors that haven't beaten yet are skipped (or, with
+ * HEARTBEAT_PREV_ALL, fail the check). If no predecessor qualifies, latency
+ * is measured from this heartbeat's own previous beat.
+ *
+ * @param hb
+ * @param user_tag
+ * @param work
+ * @param hb_prevs the predecessors, entries may be NULL
+ * @param nprevs the number of predecessors
+ * @param policy one of HEARTBEAT_PREV_LATEST, _EARLIEST, or _ALL
+ * @return timestamp
+ */
+int64_t heartbeat_join(heartbeat_t* hb,
+                       uint64_t user_tag,
+                       uint64_t work,
+                       const heartbeat_t* const* hb_prevs,
+                       unsigned int nprevs,
+                       int policy);
+
+/**
+ * Registers heartbeats for a set of heartbeats (e.g. a stage and its
+ * parent) at once, with one timestamp, one lock acquisition for heartbeats
+ * in the same tree, and one read of each energy source and of the thread's
+ * CPU statistics shared by all records.
+ *
+ * @param hbs the heartbeats, in the order their records are written
+ * @param n the number of heartbeats
+ * @param user_tag
+ * @param work the work for each heartbeat
+ * @param hb_prevs the predecessor for each heartbeat, or NULL for none;
+ *        entries may be NULL
+ * @return timestamp
+ */
+int64_t heartbeat_group(heartbeat_t* const* hbs,
+                        unsigned int n,
+                        uint64_t user_tag,
+                        const uint64_t* work,
+                        const heartbeat_t* const* hb_prevs);
+
+/**
+ * Start a span of active time, e.g. when a request arrives. The next
+ * heartbeat_end() closes it, so its record's active time excludes idle time
+ * since the previous heartbeat. Records issued without spans count their
+ * whole latency as active.
+ *
+ * @param hb
+ * @return timestamp
+ */
+int64_t heartbeat_begin(heartbeat_t* hb);
+
+/**
+ * Close the span started by heartbeat_begin() and register a heartbeat.
+ *
+ * @param hb
+ * @param user_tag
+ * @param work
+ * @return timestamp
+ */
+int64_t heartbeat_end(heartbeat_t* hb,
+                      uint64_t user_tag,
+                      uint64_t work);
+
 /**
  * Cleanup function for process that wants to register heartbeats
  *
@@ -50,6 +155,493 @@ int64_t heartbeat(heartbeat_t* hb,
  */
 void heartbeat_finish(heartbeat_t* hb);
 
+/**
+ * Enable or disable per-beat CPU statistics for the calling thread.
+ * HEARTBEAT_CPU_TIME samples CLOCK_THREAD_CPUTIME_ID on each heartbeat,
+ * HEARTBEAT_CPU_CTX_SWITCHES also samples the thread's voluntary and
+ * involuntary context switches. Must be called from the thread that issues
+ * the heartbeats since that thread's counters are used as the baseline.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param flags bitwise OR of HEARTBEAT_CPU_* flags, or 0 to disable
+ * @return 0 on success, -1 on failure
+ */
+int hb_set_cpu_stats(heartbeat_t* hb, int flags);
+
+/**
+ * Enable or disable sampling mode. In sampling mode most heartbeats only
+ * accumulate their work (and accuracy); a full record is taken every
+ * interval heartbeats and is credited with everything accumulated since the
+ * previous record, so global and window rates remain correct. The window
+ * size and the record/shared IDs then count records rather than heartbeats,
+ * and heartbeats that are not recorded return the last recorded timestamp.
+ * The first heartbeat is always recorded, starting the first interval.
+ * Accumulated heartbeats that have not been recorded yet are dropped by
+ * heartbeat_finish().
+ *
+ * The interval is adjusted at each record: if period > 0 it is scaled toward
+ * taking one record every period ns, and if budget > 0 it is grown whenever
+ * the time spent taking a record exceeds that fraction of the time since the
+ * previous record. It never drops below the initial interval unless a period
+ * is set. With a period, a record is also taken as soon as a heartbeat
+ * arrives period ns after the previous record, even if fewer than interval
+ * heartbeats have accumulated. That check reads the clock on every
+ * heartbeat while hb_tick_clock_start()'s clock is running, and otherwise
+ * only every 1/256 of an interval, so the record may come that many
+ * heartbeats late.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param interval heartbeats per record, or 0 to disable sampling
+ * @param period target ns between records, or 0
+ * @param budget max fraction of time spent recording, or 0
+ */
+void hb_set_sampling(heartbeat_t* hb,
+                     uint64_t interval,
+                     int64_t period,
+                     double budget);
+
+/**
+ * Returns the number of times the clock stepped backward (e.g. a
+ * CLOCK_REALTIME adjustment). Such heartbeats are recorded with latency 0
+ * instead of a negative latency.
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the number of corrected timestamps (uint64_t)
+ */
+uint64_t hb_get_time_corrections(const heartbeat_t* hb);
+
+/**
+ * Returns the current sampling interval, or 0 if sampling is disabled.
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the heartbeats per record (uint64_t)
+ */
+uint64_t hb_get_sampling_interval(const heartbeat_t* hb);
+
+/**
+ * Enable or disable rotation of the heartbeat's log file. After a buffer is
+ * flushed, the log is rotated if it has reached max_bytes or holds more than
+ * max_age ns of heartbeats: the current file is renamed to "<log_name>.1"
+ * (older segments shift to ".2", ".3", ...), the oldest retained segment is
+ * replaced, and a new log is started. If compress is set, rotated segments
+ * are compressed with gzip in a child process so the heartbeat doesn't wait
+ * for it; rotation is deferred to a later flush while the previous segment
+ * is still compressing. If a segment can't be renamed, the current log is
+ * kept and rotation is retried at the next flush. If the new log can't be
+ * opened, opening it (for appending) is retried at each flush and records
+ * until then are dropped.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param max_bytes rotate once the log reaches this size, or 0
+ * @param max_age rotate once the log spans this many ns, or 0
+ * @param segments the number of rotated segments to keep
+ * @param compress non-zero to gzip rotated segments
+ * @return 0 on success, -1 if the heartbeat has no log file
+ */
+int hb_set_log_rotation(heartbeat_t* hb,
+                        uint64_t max_bytes,
+                        int64_t max_age,
+                        unsigned int segments,
+                        int compress);
+
+/**
+ * Place the heartbeat's log buffer on a NUMA node. Pages already touched are
+ * migrated, the rest are allocated there when first written. Without this,
+ * pages are placed on the node of the thread that first writes them, which
+ * is normally the thread issuing heartbeats. Buffers of at least 2 MB are
+ * also advised to use transparent huge pages.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param node the NUMA node, or -1 for the calling thread's current node
+ * @return 0 on success, -1 on failure
+ */
+int hb_set_buffer_node(heartbeat_t* hb, int node);
+
+/**
+ * Returns the NUMA node the start of the heartbeat's log buffer is on. If it
+ * hasn't been written yet, returns the node set with hb_set_buffer_node().
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the NUMA node, or -1 if not placed yet or on failure
+ */
+int hb_get_buffer_node(const heartbeat_t* hb);
+
+/**
+ * Register for events raised while processing heartbeats: when each window
+ * of window_size records completes, and when window values cross the bounds
+ * set with hb_set_*_bounds() (events fire on the crossing, not on every beat
+ * outside the bounds). Bounds are only evaluated once the first window is
+ * full.
+ *
+ * With HEARTBEAT_EVENT_INLINE, func is called by the thread issuing the
+ * heartbeat. With HEARTBEAT_EVENT_DEFERRED, events are queued and func is
+ * called by a dispatcher thread so it doesn't add to the heartbeat's own
+ * latency. With HEARTBEAT_EVENT_NOTIFY, events are queued and signaled on
+ * the eventfd from hb_get_event_fd(); func may be NULL and events are
+ * retrieved with hb_next_event(). Events that don't fit in the queue are
+ * dropped and counted.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param func the callback, or NULL to disable events
+ * @param arg passed to func
+ * @param delivery one of HEARTBEAT_EVENT_INLINE, _DEFERRED, or _NOTIFY
+ * @param queue_size max queued events for deferred delivery
+ * @return 0 on success, -1 on failure
+ */
+int hb_set_event_handler(heartbeat_t* hb,
+                         hb_event_func* func,
+                         void* arg,
+                         int delivery,
+                         uint64_t queue_size);
+
+/**
+ * Set the window rate bounds that raise HEARTBEAT_EVENT_PERF_* events.
+ * Use -INFINITY or INFINITY to leave a side unbounded.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param min the minimum window rate
+ * @param max the maximum window rate
+ */
+void hb_set_perf_bounds(heartbeat_t* hb, double min, double max);
+
+/**
+ * Returns the eventfd signaled when events are queued, or -1 if events are
+ * delivered inline.
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the eventfd (int)
+ */
+int hb_get_event_fd(const heartbeat_t* hb);
+
+/**
+ * Dequeue the next event when using HEARTBEAT_EVENT_NOTIFY. Must only be
+ * called by one thread at a time.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param events filled with the HEARTBEAT_EVENT_* flags
+ * @param record filled with the record that raised the events
+ * @return 1 if an event was dequeued, 0 if there were none
+ */
+int hb_next_event(heartbeat_t* hb,
+                  int* events,
+                  heartbeat_record_t* record);
+
+/**
+ * Returns the number of events dropped because the queue was full.
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the dropped events (uint64_t)
+ */
+uint64_t hb_get_dropped_events(const heartbeat_t* hb);
+
+/**
+ * Enable online change-point detection on the instant rate and power, which
+ * marks the beats where the workload enters a new phase and raises
+ * HEARTBEAT_EVENT_PHASE. A two-sided CUSUM is run on each signal, normalized
+ * by the mean and standard deviation of the first min_beats heartbeats of
+ * the current phase; a boundary is reported once either sum exceeds
+ * threshold, at the beat where that sum started to grow. Deviations are
+ * clipped to threshold / 2 so isolated outliers don't end a phase. The
+ * controller set with hb_set_controller() relearns its model at each
+ * boundary.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param threshold the decision threshold in standard deviations (e.g. 5),
+ *        or 0 to disable
+ * @param drift the deviation ignored per beat in standard deviations
+ *        (e.g. 0.5)
+ * @param min_beats the heartbeats used to learn each phase's baseline, >= 2
+ * @return 0 on success, -1 on failure
+ */
+int hb_set_phase_detection(heartbeat_t* hb,
+                           double threshold,
+                           double drift,
+                           uint64_t min_beats);
+
+/**
+ * Returns the number of phase boundaries detected.
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the phase boundaries (uint64_t)
+ */
+uint64_t hb_get_phase_count(const heartbeat_t* hb);
+
+/**
+ * Returns the beat numbers of the last n phase boundaries, oldest first. At
+ * most HEARTBEAT_PHASES_MAX are kept. Safe to call from threads other than
+ * the one issuing heartbeats.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param ids filled with beat numbers
+ * @param n uint64_t
+ * @return the number of beat numbers copied
+ */
+uint64_t hb_get_phases(const heartbeat_t* hb, uint64_t* ids, uint64_t n);
+
+/**
+ * Keep a compressed history of records in addition to the log buffer, so
+ * hb_get_compressed_history() can cover far more heartbeats than
+ * buffer_depth at a few bytes per heartbeat for steady workloads. Integers
+ * are delta encoded and doubles XOR encoded against the previous record in
+ * blocks; derived values (rates, power, ...) aren't stored but recomputed
+ * when read. The oldest blocks are dropped once the capacity is reached.
+ * Energy domains added after this is called are not kept. If a block can't
+ * be allocated, the history so far stays readable but stops growing.
+ * Resizing or disabling discards the history so far; it's safe to do while
+ * other threads read it.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param records the number of records to keep, or 0 to disable
+ * @return 0 on success, -1 on failure
+ */
+int hb_set_compressed_history(heartbeat_t* hb, uint64_t records);
+
+/**
+ * Returns heartbeat information for the last n heartbeats from the
+ * compressed history. Safe to call from threads other than the one issuing
+ * heartbeats, but blocks the producer while decoding. Only records whose
+ * whole window is in the history are returned.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param record pointer to heartbeat_record_t
+ * @param n uint64_t
+ * @return the number of records decoded
+ */
+uint64_t hb_get_compressed_history(const heartbeat_t* hb,
+                                   heartbeat_record_t* record,
+                                   uint64_t n);
+
+/**
+ * Returns the memory used by the compressed history's encoded data.
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the size in bytes
+ */
+uint64_t hb_get_compressed_history_size(const heartbeat_t* hb);
+
+/**
+ * Add a rollup tier that summarizes heartbeats in fixed time intervals (e.g.
+ * 1000000000 for per-second buckets), updated as heartbeats are issued.
+ * Buckets are kept in a ring, so a tier covers the last interval * buckets
+ * nanoseconds in constant memory. Up to HEARTBEAT_ROLLUP_TIERS_MAX tiers may
+ * be added; do so before heartbeats are issued.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param interval the bucket length in nanoseconds
+ * @param buckets the number of buckets to keep
+ * @return the tier index, or -1 on failure
+ */
+int hb_add_rollup(heartbeat_t* hb, int64_t interval, uint64_t buckets);
+
+/**
+ * Returns the non-empty buckets of a rollup tier that start in [from, to),
+ * oldest first. Safe to call from threads other than the one issuing
+ * heartbeats.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param tier the index returned by hb_add_rollup()
+ * @param from the earliest bucket start time (inclusive)
+ * @param to the latest bucket start time (exclusive)
+ * @param buckets pointer to heartbeat_rollup_t
+ * @param n the maximum number of buckets to return
+ * @return the number of buckets copied
+ */
+uint64_t hb_get_rollup(const heartbeat_t* hb,
+                       unsigned int tier,
+                       int64_t from,
+                       int64_t to,
+                       heartbeat_rollup_t* buckets,
+                       uint64_t n);
+
+/**
+ * Merge the buckets of a rollup tier that start in [from, to) into one,
+ * whose start is that of the oldest bucket merged.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param tier the index returned by hb_add_rollup()
+ * @param from the earliest bucket start time (inclusive)
+ * @param to the latest bucket start time (exclusive)
+ * @param summary pointer to heartbeat_rollup_t
+ * @return 0 on success, -1 on failure
+ */
+int hb_get_rollup_summary(const heartbeat_t* hb,
+                          unsigned int tier,
+                          int64_t from,
+                          int64_t to,
+                          heartbeat_rollup_t* summary);
+
+/* Buffer size that always fits one record formatted by hb_format_record() */
+#define HEARTBEAT_RECORD_TEXT_MAX 4352
+
+/**
+ * Format a record as a line of the text log.
+ *
+ * @param hbr
+ * @param buf the output buffer, not NUL terminated
+ * @param size the size of buf
+ * @return the number of characters written, or 0 if buf is too small
+ */
+size_t hb_format_record(const heartbeat_record_t* hbr, char* buf, size_t size);
+
+/**
+ * Initialize a heartbeats instance whose shared data lives in a named POSIX
+ * shared memory segment, so that heartbeats in other processes created with
+ * the same name (and their children) form one tree with a common shared_id
+ * order. The segment is created by the first process and unlinked when the
+ * last heartbeat attached to it finishes.
+ *
+ * Attached processes hold a shared flock() on the segment, which the kernel
+ * releases if they die. A segment left behind by processes that all crashed
+ * is therefore unlocked, and the next process to attach with the name
+ * unlinks it and starts a fresh one. Attaching fails if the segment isn't
+ * initialized within HEARTBEAT_SHARED_TIMEOUT ns (1 s by default), e.g.
+ * because its creator died; a later attach then reclaims it. A segment can
+ * also be removed by hand with shm_unlink() (/dev/shm/<name> on Linux).
+ *
+ * All processes must be built with the same HEARTBEAT_USE_PTHREADS_LOCK
+ * setting. With the lock, a robust process-shared mutex orders heartbeats
+ * and survives a process dying while holding it; without it, only the
+ * shared_id counter is kept consistent (atomically).
+ *
+ * @param shm_name the segment name, e.g. "/my-pipeline"
+ * @param window_size
+ * @param buffer_depth
+ * @param log_name
+ * @return heartbeat_t or NULL on failure
+ */
+heartbeat_t* heartbeat_init_shared(const char* shm_name,
+                                   uint64_t window_size,
+                                   uint64_t buffer_depth,
+                                   const char* log_name);
+
+/**
+ * Initialize a heartbeats instance that continues from the state in a file
+ * (if it exists) and keeps that file up to date, so that global and window
+ * statistics are continuous across restarts. See hb_restore_state() and
+ * hb_set_state_file().
+ *
+ * @param parent
+ * @param window_size
+ * @param buffer_depth
+ * @param log_name
+ * @param state_name the state file
+ * @return heartbeat_t or NULL on failure
+ */
+heartbeat_t* heartbeat_init_restore(heartbeat_t* parent,
+                                    uint64_t window_size,
+                                    uint64_t buffer_depth,
+                                    const char* log_name,
+                                    const char* state_name);
+
+/**
+ * Save a heartbeat's counters, running totals and last window of records to
+ * a file. The file is replaced atomically.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param state_name the state file
+ * @return 0 on success, -1 on failure
+ */
+int hb_save_state(const heartbeat_t* hb, const char* state_name);
+
+/**
+ * Restore a heartbeat from a file written by hb_save_state() or
+ * hb_set_state_file(). Must be called before the first heartbeat. The time
+ * between the saved and the next heartbeat is not counted: the next
+ * heartbeat starts a new interval, as the first one normally does.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param state_name the state file
+ * @return 0 on success, -1 on failure (including if the file doesn't exist)
+ */
+int hb_restore_state(heartbeat_t* hb, const char* state_name);
+
+/**
+ * Map a state file that is updated with every record, so it can be restored
+ * from even after a crash. Writes go to the page cache, so this costs a
+ * record copy per heartbeat rather than any I/O. The file is first written
+ * in full under a temporary name and renamed into place, so an existing file
+ * (e.g. the one just restored from) survives a crash while it's replaced.
+ * The totals are kept twice and updated alternately, so a crash in the
+ * middle of an update restores the state from one record earlier.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param state_name the state file
+ * @return 0 on success, -1 on failure
+ */
+int hb_set_state_file(heartbeat_t* hb, const char* state_name);
+
+/**
+ * Set the window rate goal for the built-in controller. While the window
+ * rate is within [min, max] the recommended knob is held; outside it the
+ * controller steers toward the middle of the range (or toward the finite
+ * bound if the other is infinite).
+ *
+ * @param hb pointer to heartbeat_t
+ * @param min the minimum target rate
+ * @param max the maximum target rate
+ */
+void hb_set_target_rate(heartbeat_t* hb, double min, double max);
+
+/**
+ * Enable the built-in feedback controller, which recommends a knob setting
+ * (thread count, frequency level, quality level, ...) after each window.
+ * It assumes the rate is roughly proportional to the knob, tracks the rate
+ * per knob unit with a Kalman filter, and applies a first order control law
+ * whose speed is set by the pole: 0 corrects the whole error in one window
+ * (deadbeat), values closer to 1 are slower but more robust.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param knob_min the lowest knob setting
+ * @param knob_max the highest knob setting
+ * @param knob the current knob setting
+ * @param pole in [0, 1)
+ */
+void hb_set_controller(heartbeat_t* hb,
+                       double knob_min,
+                       double knob_max,
+                       double knob,
+                       double pole);
+
+/**
+ * Tell the controller the knob setting actually applied, e.g. after
+ * rounding its recommendation to a discrete level.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param knob the knob setting
+ */
+void hb_set_knob(heartbeat_t* hb, double knob);
+
+/**
+ * Returns the controller's recommended knob setting, updated as each window
+ * completes (before window events are raised).
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the knob setting (double)
+ */
+double hb_get_knob(const heartbeat_t* hb);
+
+/**
+ * Start a background thread that updates a shared, coarse-grained timestamp
+ * every resolution ns. While it runs, heartbeats in this process read that
+ * timestamp instead of calling clock_gettime(), so timestamps and latencies
+ * are only accurate to about the resolution. Heartbeats that land in the
+ * same tick have a latency of 0 and instant rates of 0; global and window
+ * rates come from the accumulated time, so windows should span several
+ * ticks for window rates to be meaningful. Resolutions below 50 us
+ * (HEARTBEAT_TICK_SPIN_THRESHOLD at build time) busy-wait, dedicating a core
+ * to the clock thread.
+ *
+ * @param resolution the update period in ns
+ * @return 0 on success, -1 on failure or if the clock is already running
+ */
+int hb_tick_clock_start(int64_t resolution);
+
+/**
+ * Stop the background clock thread started by hb_tick_clock_start().
+ * Heartbeats go back to calling clock_gettime().
+ */
+void hb_tick_clock_stop(void);
+
 /**
  * Return the heartbeat's parent, or NULL if it doesn't have one.
  *
@@ -141,8 +733,90 @@ double hb_get_window_rate(const heartbeat_t* hb);
 double hb_get_instant_rate(const heartbeat_t* hb);
 
 /**
- * Returns the record for the current heartbeat
- * currently may read old data
+ * Returns the total active time, see heartbeat_begin().
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the active time in nanoseconds (int64_t)
+ */
+int64_t hb_get_global_active_time(const heartbeat_t* hb);
+
+/**
+ * Returns the active time over the current window.
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the active time in nanoseconds (int64_t)
+ */
+int64_t hb_get_window_active_time(const heartbeat_t* hb);
+
+/**
+ * Returns the rate over active time, since initialization.
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the rate (double)
+ */
+double hb_get_global_active_rate(const heartbeat_t* hb);
+
+/**
+ * Returns the rate over active time, for the current window.
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the rate (double)
+ */
+double hb_get_window_active_rate(const heartbeat_t* hb);
+
+/**
+ * Returns the rate over active time, for the last heartbeat.
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the rate (double)
+ */
+double hb_get_instant_active_rate(const heartbeat_t* hb);
+
+/**
+ * Get the total CPU time (ns) for the life of this heartbeat.
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the total CPU time (int64_t)
+ */
+int64_t hb_get_global_cpu_time(const heartbeat_t* hb);
+
+/**
+ * Get the current window CPU time (ns) for this heartbeat.
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the window CPU time (int64_t)
+ */
+int64_t hb_get_window_cpu_time(const heartbeat_t* hb);
+
+/**
+ * Returns the CPU utilization (CPU time / elapsed time) over the life of the
+ * entire application
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the CPU utilization (double) over the entire life of the application
+ */
+double hb_get_global_cpu_utilization(const heartbeat_t* hb);
+
+/**
+ * Returns the CPU utilization over the last window (as specified to init)
+ * heartbeats
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the CPU utilization (double) over the last window
+ */
+double hb_get_window_cpu_utilization(const heartbeat_t* hb);
+
+/**
+ * Returns the CPU utilization for the last heartbeat.
+ *
+ * @param hb pointer to heartbeat_t
+ * @return the CPU utilization (double) for the last heartbeat
+ */
+double hb_get_instant_cpu_utilization(const heartbeat_t* hb);
+
+/**
+ * Returns the record for the current heartbeat.
+ * Safe to call from threads other than the one issuing heartbeats.
  *
  * @param hb pointer to heartbeat_t
  * @param record pointer to record to fill
@@ -152,15 +826,62 @@ void hb_get_current(const heartbeat_t* hb,
 
 /**
  * Returns all heartbeat information for the last n heartbeats
- *
+ * Safe to call from threads other than the one issuing heartbeats; readers
+ * never block the producer. If the producer overwrites the oldest requested
+ * records during the copy, they are dropped and fewer records are returned.
+ *
  * @param hb pointer to heartbeat_t
  * @param record pointer to heartbeat_record_t
  * @param n uint64_t
+ * @return the number of records copied
  */
 uint64_t hb_get_history(const heartbeat_t* hb,
                         heartbeat_record_t* record,
                         uint64_t n);
 
+/**
+ * Get a view of the last n records in place in the log buffer instead of
+ * copying them as hb_get_history() does. The records are in up to two
+ * contiguous runs (when they wrap around the end of the buffer), oldest
+ * first. The producer isn't blocked and may overwrite the oldest records
+ * while they're read, so check the view with hb_check_history_view() after
+ * reading.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param n uint64_t
+ * @param view pointer to heartbeat_history_view_t
+ * @return the number of records in the view
+ */
+uint64_t hb_get_history_view(const heartbeat_t* hb,
+                             uint64_t n,
+                             heartbeat_history_view_t* view);
+
+/**
+ * Returns the number of records at the start of a view that may have been
+ * overwritten since it was taken; results read from them must be dropped.
+ *
+ * @param hb pointer to heartbeat_t
+ * @param view pointer to heartbeat_history_view_t
+ * @return the number of invalid records, 0 if the whole view is valid
+ */
+uint64_t hb_check_history_view(const heartbeat_t* hb,
+                               const heartbeat_history_view_t* view);
+
+/**
+ * Compute the sum, min, max, mean and (population) variance of a record
+ * field over a view, e.g. offsetof(heartbeat_record_t, latency). Works on
+ * the records in place; check the view afterward.
+ *
+ * @param view pointer to heartbeat_history_view_t
+ * @param offset the field's offset in heartbeat_record_t
+ * @param type one of HEARTBEAT_FIELD_DOUBLE, _INT64, or _UINT64
+ * @param stats pointer to heartbeat_field_stats_t, zeroed if the view is empty
+ */
+void hb_get_field_stats(const heartbeat_history_view_t* view,
+                        size_t offset,
+                        int type,
+                        heartbeat_field_stats_t* stats);
+
 /**
  * Returns the local heartbeat number for this record.
  *
@@ -193,6 +914,16 @@ uint64_t hbr_get_user_tag(const heartbeat_record_t* hbr);
  */
 int64_t hbr_get_timestamp(const heartbeat_record_t* hbr);
 
+/**
+ * Returns the index of the predecessor this record's latency was measured
+ * from: 0 for the hb_prev of heartbeat(), or the index in hb_prevs for
+ * heartbeat_join().
+ *
+ * @param hbr
+ * @return the index, or -1 if measured from the previous record
+ */
+int64_t hbr_get_critical_prev(const heartbeat_record_t* hbr);
+
 /**
  * Returns the work completed for this record.
  *
@@ -233,6 +964,142 @@ double hbr_get_window_rate(const heartbeat_record_t* hbr);
  */
 double hbr_get_instant_rate(const heartbeat_record_t* hbr);
 
+/**
+ * Returns the active time for this record, see heartbeat_begin().
+ *
+ * @param hbr
+ * @return the active time in nanoseconds (int64_t)
+ */
+int64_t hbr_get_active_time(const heartbeat_record_t* hbr);
+
+/**
+ * Returns the global rate over active time for this record.
+ *
+ * @param hbr
+ * @return the rate (double)
+ */
+double hbr_get_global_active_rate(const heartbeat_record_t* hbr);
+
+/**
+ * Returns the window rate over active time for this record.
+ *
+ * @param hbr
+ * @return the rate (double)
+ */
+double hbr_get_window_active_rate(const heartbeat_record_t* hbr);
+
+/**
+ * Returns the instant rate over active time for this record.
+ *
+ * @param hbr
+ * @return the rate (double)
+ */
+double hbr_get_instant_active_rate(const heartbeat_record_t* hbr);
+
+/**
+ * Returns the CPU time (ns) consumed by the heartbeat thread for this record.
+ *
+ * @param hbr
+ * @return the CPU time (int64_t)
+ */
+int64_t hbr_get_cpu_time(const heartbeat_record_t* hbr);
+
+/**
+ * Returns the voluntary context switches for this record.
+ *
+ * @param hbr
+ * @return the voluntary context switches (uint64_t)
+ */
+uint64_t hbr_get_voluntary_ctx_switches(const heartbeat_record_t* hbr);
+
+/**
+ * Returns the involuntary context switches for this record.
+ *
+ * @param hbr
+ * @return the involuntary context switches (uint64_t)
+ */
+uint64_t hbr_get_involuntary_ctx_switches(const heartbeat_record_t* hbr);
+
+/**
+ * Returns the global CPU utilization recorded in this record.
+ *
+ * @param hbr
+ * @return the global CPU utilization (double)
+ */
+double hbr_get_global_cpu_utilization(const heartbeat_record_t* hbr);
+
+/**
+ * Returns the window CPU utilization recorded in this record.
+ *
+ * @param hbr
+ * @return the window CPU utilization (double)
+ */
+double hbr_get_window_cpu_utilization(const heartbeat_record_t* hbr);
+
+/**
+ * Returns the instant CPU utilization recorded in this record.
+ *
+ * @param hbr
+ * @return the instant CPU utilization (double)
+ */
+double hbr_get_instant_cpu_utilization(const heartbeat_record_t* hbr);
+
+/**
+ * Returns the start time of a rollup bucket.
+ *
+ * @param hbru pointer to heartbeat_rollup_t
+ * @return the start time in nanoseconds (int64_t)
+ */
+int64_t hbru_get_start(const heartbeat_rollup_t* hbru);
+
+/**
+ * Returns the number of heartbeats in a rollup bucket.
+ *
+ * @param hbru pointer to heartbeat_rollup_t
+ * @return the count (uint64_t)
+ */
+uint64_t hbru_get_count(const heartbeat_rollup_t* hbru);
+
+/**
+ * Returns the work completed in a rollup bucket.
+ *
+ * @param hbru pointer to heartbeat_rollup_t
+ * @return the work (uint64_t)
+ */
+uint64_t hbru_get_work(const heartbeat_rollup_t* hbru);
+
+/**
+ * Returns the sum of heartbeat latencies in a rollup bucket.
+ *
+ * @param hbru pointer to heartbeat_rollup_t
+ * @return the time in nanoseconds (int64_t)
+ */
+int64_t hbru_get_time(const heartbeat_rollup_t* hbru);
+
+/**
+ * Returns the smallest heartbeat latency in a rollup bucket.
+ *
+ * @param hbru pointer to heartbeat_rollup_t
+ * @return the latency in nanoseconds (int64_t)
+ */
+int64_t hbru_get_min_latency(const heartbeat_rollup_t* hbru);
+
+/**
+ * Returns the largest heartbeat latency in a rollup bucket.
+ *
+ * @param hbru pointer to heartbeat_rollup_t
+ * @return the latency in nanoseconds (int64_t)
+ */
+int64_t hbru_get_max_latency(const heartbeat_rollup_t* hbru);
+
+/**
+ * Returns the rate of work over a rollup bucket's heartbeats.
+ *
+ * @param hbru pointer to heartbeat_rollup_t
+ * @return the rate (double)
+ */
+double hbru_get_rate(const heartbeat_rollup_t* hbru);
+
 #ifdef __cplusplus
  }
 #endif
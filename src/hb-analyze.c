@@ -0,0 +1,804 @@
+/**
+ *  Offline analysis of heartbeat text logs.
+ *
+ *  Each log is treated as one stage (e.g. the recv/work/send logs written by
+ *  the pipeline example). Logs are mmap'd and parsed in parallel chunks with
+ *  per-chunk histograms, and each chunk only holds the time buckets its
+ *  records span, so memory is bounded by the number of chunks and time
+ *  buckets rather than by log size.
+ *
+ *  @author Connor Imes
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// log columns we use (see hb_flush_buffer())
+#define COL_SID       1
+#define COL_TIMESTAMP 3
+#define COL_WORK      4
+#define COL_LATENCY   5
+#define COL_ACCURACY  9
+#define COL_ENERGY    13
+#define LOG_COLUMNS   17
+
+// log-linear latency histogram: 2^HIST_SUB_BITS sub-buckets per power of 2
+#define HIST_SUB_BITS 6
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+// a coarser one (within 12.5%) per time bucket
+#define BUCKET_HIST_SUB_BITS 3
+#define BUCKET_HIST_BUCKETS  ((64 - BUCKET_HIST_SUB_BITS + 1) << BUCKET_HIST_SUB_BITS)
+
+// split logs into more chunks than threads to balance uneven lines
+#define CHUNKS_PER_THREAD 4
+
+typedef struct {
+  uint64_t sid;
+  int64_t timestamp;
+  uint64_t work;
+  int64_t latency;
+  double accuracy;
+  double energy;
+} hba_record;
+
+typedef struct {
+  uint64_t records;
+  uint64_t work;
+  int64_t time;
+  double accuracy;
+  double energy;
+  int64_t latency_max;
+} hba_totals;
+
+typedef struct {
+  hba_totals total;
+  uint64_t hist[BUCKET_HIST_BUCKETS];
+} hba_bucket;
+
+typedef struct {
+  hba_totals total;
+  uint64_t hist[HIST_BUCKETS];
+  // time buckets first_bucket to first_bucket + nbuckets - 1
+  hba_bucket* buckets;
+  uint64_t first_bucket;
+  uint64_t nbuckets;
+  uint64_t bad_lines;
+} hba_stats;
+
+typedef struct {
+  const char* name;
+  const char* data;
+  size_t size;
+  const char* body;
+  const char* end;
+  hba_stats stats;
+} hba_log;
+
+typedef struct {
+  hba_log* log;
+  const char* start;
+  const char* end;
+  hba_stats stats;
+} hba_task;
+
+typedef struct {
+  hba_task* tasks;
+  uint64_t ntasks;
+  uint64_t next;
+  int64_t t0;
+  int64_t bucket_width;
+} hba_work_queue;
+
+// histograms with 2^bits sub-buckets per power of 2
+static inline unsigned int hist_index(uint64_t v, unsigned int bits) {
+  uint64_t sub = 1ULL << bits;
+  if (v < sub) {
+    return (unsigned int) v;
+  }
+  unsigned int e = 63 - __builtin_clzll(v);
+  return ((e - bits + 1) << bits) +
+         (unsigned int) ((v >> (e - bits)) & (sub - 1));
+}
+
+static inline uint64_t hist_value(unsigned int i, unsigned int bits) {
+  unsigned int sub = 1U << bits;
+  if (i < sub) {
+    return i;
+  }
+  unsigned int e = (i >> bits) + bits - 1;
+  return ((uint64_t) (sub + (i & (sub - 1)))) << (e - bits);
+}
+
+static inline const char* skip_spaces(const char* p, const char* end) {
+  while (p < end && (*p == ' ' || *p == '\t')) {
+    p++;
+  }
+  return p;
+}
+
+static inline const char* skip_token(const char* p, const char* end) {
+  while (p < end && *p != ' ' && *p != '\t' && *p != '\n') {
+    p++;
+  }
+  return p;
+}
+
+static inline const char* parse_u64(const char* p, const char* end, uint64_t* v) {
+  uint64_t x = 0;
+  const char* s = p;
+  while (p < end && *p >= '0' && *p <= '9') {
+    x = x * 10 + (uint64_t) (*p - '0');
+    p++;
+  }
+  *v = x;
+  return p == s ? NULL : p;
+}
+
+static inline const char* parse_double(const char* p, const char* end, double* v) {
+  static const double scale[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8,
+                                  1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15 };
+  const char* s = p;
+  int neg = 0;
+  uint64_t ip;
+  uint64_t fp = 0;
+  int digits = 0;
+  if (p < end && *p == '-') {
+    neg = 1;
+    p++;
+  }
+  p = parse_u64(p, end, &ip);
+  if (p != NULL && p < end && *p == '.') {
+    for (p++; p < end && *p >= '0' && *p <= '9' && digits < 15; p++, digits++) {
+      fp = fp * 10 + (uint64_t) (*p - '0');
+    }
+  }
+  if (p == NULL || (p < end && *p != ' ' && *p != '\t' && *p != '\n')) {
+    // nan, inf, or more precision than we handle - let libc do it
+    char buf[64];
+    const char* t = skip_token(s, end);
+    size_t len = (size_t) (t - s) < sizeof(buf) - 1 ? (size_t) (t - s) : sizeof(buf) - 1;
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    *v = strtod(buf, NULL);
+    return t;
+  }
+  *v = (double) ip + (double) fp / scale[digits];
+  if (neg) {
+    *v = -*v;
+  }
+  return p;
+}
+
+/**
+ * Parse one log line starting at p.
+ * Returns the start of the next line, sets *ok to 0 if the line is malformed.
+ */
+static const char* parse_record(const char* p, const char* end,
+                                hba_record* r, int* ok) {
+  const char* line = p;
+  uint64_t u;
+  double d;
+  int col;
+  *ok = 1;
+  for (col = 0; col < LOG_COLUMNS && *ok; col++) {
+    p = skip_spaces(p, end);
+    switch (col) {
+      case COL_SID:
+      case COL_TIMESTAMP:
+      case COL_WORK:
+      case COL_LATENCY:
+        p = parse_u64(p, end, &u);
+        if (p == NULL) {
+          *ok = 0;
+          break;
+        }
+        if (col == COL_SID) {
+          r->sid = u;
+        } else if (col == COL_TIMESTAMP) {
+          r->timestamp = (int64_t) u;
+        } else if (col == COL_WORK) {
+          r->work = u;
+        } else {
+          // latency is logged as unsigned
+          r->latency = (int64_t) u;
+        }
+        break;
+      case COL_ACCURACY:
+      case COL_ENERGY:
+        p = parse_double(p, end, &d);
+        if (col == COL_ACCURACY) {
+          r->accuracy = d;
+        } else {
+          r->energy = d;
+        }
+        break;
+      default:
+        p = skip_token(p, end);
+        break;
+    }
+  }
+  if (p == NULL) {
+    p = line;
+  }
+  p = memchr(p, '\n', (size_t) (end - p));
+  return p == NULL ? end : p + 1;
+}
+
+static inline void totals_add(hba_totals* t, const hba_record* r) {
+  t->records++;
+  t->work += r->work;
+  t->time += r->latency;
+  t->accuracy += r->accuracy;
+  t->energy += r->energy;
+  if (r->latency > t->latency_max) {
+    t->latency_max = r->latency;
+  }
+}
+
+static inline void totals_merge(hba_totals* t, const hba_totals* o) {
+  t->records += o->records;
+  t->work += o->work;
+  t->time += o->time;
+  t->accuracy += o->accuracy;
+  t->energy += o->energy;
+  if (o->latency_max > t->latency_max) {
+    t->latency_max = o->latency_max;
+  }
+}
+
+/**
+ * Returns time bucket b, growing the range of buckets held to include it,
+ * or NULL if out of memory. The range starts at the first bucket used, so a
+ * chunk's stats only hold the buckets its records span.
+ */
+static hba_bucket* stats_bucket(hba_stats* s, uint64_t b) {
+  if (s->nbuckets == 0 || b < s->first_bucket ||
+      b - s->first_bucket >= s->nbuckets) {
+    uint64_t first = s->nbuckets == 0 || b < s->first_bucket ? b : s->first_bucket;
+    uint64_t last = s->nbuckets == 0 || b >= s->first_bucket + s->nbuckets ?
+                    b : s->first_bucket + s->nbuckets - 1;
+    uint64_t shift = s->nbuckets == 0 ? 0 : s->first_bucket - first;
+    uint64_t n = s->nbuckets ? s->nbuckets : 16;
+    while (n <= last - first) {
+      n *= 2;
+    }
+    hba_bucket* tmp = realloc(s->buckets, n * sizeof(hba_bucket));
+    if (tmp == NULL) {
+      return NULL;
+    }
+    memmove(tmp + shift, tmp, s->nbuckets * sizeof(hba_bucket));
+    memset(tmp, 0, shift * sizeof(hba_bucket));
+    memset(tmp + shift + s->nbuckets, 0,
+           (n - shift - s->nbuckets) * sizeof(hba_bucket));
+    s->buckets = tmp;
+    s->first_bucket = first;
+    s->nbuckets = n;
+  }
+  return &s->buckets[b - s->first_bucket];
+}
+
+static inline void bucket_add(hba_bucket* b, const hba_record* r) {
+  totals_add(&b->total, r);
+  if (r->latency > 0) {
+    b->hist[hist_index((uint64_t) r->latency, BUCKET_HIST_SUB_BITS)]++;
+  }
+}
+
+static int stats_merge(hba_stats* s, const hba_stats* o) {
+  hba_bucket* b;
+  uint64_t i;
+  uint64_t j;
+  totals_merge(&s->total, &o->total);
+  s->bad_lines += o->bad_lines;
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    s->hist[i] += o->hist[i];
+  }
+  for (i = 0; i < o->nbuckets; i++) {
+    if (o->buckets[i].total.records == 0) {
+      continue;
+    }
+    b = stats_bucket(s, o->first_bucket + i);
+    if (b == NULL) {
+      return -1;
+    }
+    totals_merge(&b->total, &o->buckets[i].total);
+    for (j = 0; j < BUCKET_HIST_BUCKETS; j++) {
+      b->hist[j] += o->buckets[i].hist[j];
+    }
+  }
+  return 0;
+}
+
+static void* parse_worker(void* arg) {
+  hba_work_queue* q = (hba_work_queue*) arg;
+  hba_record r;
+  hba_bucket* b;
+  int ok;
+  uint64_t t;
+  while ((t = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED)) < q->ntasks) {
+    hba_task* task = &q->tasks[t];
+    const char* p = task->start;
+    while (p < task->end) {
+      p = parse_record(p, task->log->end, &r, &ok);
+      if (!ok) {
+        task->stats.bad_lines++;
+        continue;
+      }
+      totals_add(&task->stats.total, &r);
+      if (r.latency > 0) {
+        task->stats.hist[hist_index((uint64_t) r.latency, HIST_SUB_BITS)]++;
+      }
+      if (q->bucket_width > 0 && r.timestamp >= q->t0) {
+        b = stats_bucket(&task->stats,
+                         (uint64_t) ((r.timestamp - q->t0) / q->bucket_width));
+        if (b != NULL) {
+          bucket_add(b, &r);
+        }
+      }
+    }
+  }
+  return NULL;
+}
+
+static int open_log(hba_log* log, const char* name) {
+  struct stat st;
+  memset(log, 0, sizeof(hba_log));
+  log->name = name;
+  int fd = open(name, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st)) {
+    fprintf(stderr, "%s: %s\n", name, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  log->size = (size_t) st.st_size;
+  if (log->size > 0) {
+    log->data = mmap(NULL, log->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (log->data == MAP_FAILED) {
+      fprintf(stderr, "%s: mmap: %s\n", name, strerror(errno));
+      close(fd);
+      return -1;
+    }
+    madvise((void*) log->data, log->size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+  log->end = log->data + log->size;
+  // skip header
+  log->body = log->data;
+  if (log->size > 0 && (log->data[0] < '0' || log->data[0] > '9')) {
+    log->body = memchr(log->data, '\n', log->size);
+    log->body = log->body == NULL ? log->end : log->body + 1;
+  }
+  return 0;
+}
+
+static void close_log(hba_log* log) {
+  if (log->size > 0) {
+    munmap((void*) log->data, log->size);
+  }
+  free(log->stats.buckets);
+}
+
+static const char* stage_name(const char* path) {
+  const char* s = strrchr(path, '/');
+  return s == NULL ? path : s + 1;
+}
+
+static uint64_t hist_percentile(const uint64_t* hist, unsigned int n,
+                                unsigned int bits, double pct) {
+  uint64_t count = 0;
+  unsigned int i;
+  for (i = 0; i < n; i++) {
+    count += hist[i];
+  }
+  if (count == 0) {
+    return 0;
+  }
+  uint64_t rank = (uint64_t) (pct / 100.0 * (count - 1));
+  uint64_t seen = 0;
+  for (i = 0; i < n; i++) {
+    seen += hist[i];
+    if (seen > rank) {
+      return hist_value(i, bits);
+    }
+  }
+  return 0;
+}
+
+static double ratio(double num, double den) {
+  return den == 0 ? 0.0 : num / den;
+}
+
+static void print_stage(const char* name, const hba_stats* s) {
+  const hba_totals* t = &s->total;
+  double seconds = t->time / 1000000000.0;
+  printf("%-24s %10" PRIu64 " %12" PRIu64 " %12.3f %14.3f %12.0f %12" PRIu64
+         " %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %12" PRId64
+         " %10.3f %12.3f %12.6f\n",
+         name, t->records, t->work, seconds, ratio(t->work, seconds),
+         ratio(t->time, t->records),
+         hist_percentile(s->hist, HIST_BUCKETS, HIST_SUB_BITS, 50.0),
+         hist_percentile(s->hist, HIST_BUCKETS, HIST_SUB_BITS, 90.0),
+         hist_percentile(s->hist, HIST_BUCKETS, HIST_SUB_BITS, 99.0),
+         hist_percentile(s->hist, HIST_BUCKETS, HIST_SUB_BITS, 99.9),
+         t->latency_max,
+         ratio(t->energy, seconds), t->energy, ratio(t->energy, t->work));
+}
+
+static void print_buckets(hba_log* logs, int nlogs, int64_t bucket_width) {
+  uint64_t first = UINT64_MAX;
+  uint64_t end = 0;
+  uint64_t b;
+  int i;
+  for (i = 0; i < nlogs; i++) {
+    if (logs[i].stats.nbuckets == 0) {
+      continue;
+    }
+    first = logs[i].stats.first_bucket < first ? logs[i].stats.first_bucket : first;
+    b = logs[i].stats.first_bucket + logs[i].stats.nbuckets;
+    end = b > end ? b : end;
+  }
+  printf("\n%-12s %-24s %10s %12s %14s %12s %12s %12s %12s %12s %10s %12s\n",
+         "bucket_s", "stage", "records", "work", "rate", "lat_mean", "lat_p50",
+         "lat_p90", "lat_p99", "lat_max", "power", "J/work");
+  for (b = first; b < end; b++) {
+    for (i = 0; i < nlogs; i++) {
+      const hba_stats* s = &logs[i].stats;
+      if (s->nbuckets == 0 || b < s->first_bucket ||
+          b - s->first_bucket >= s->nbuckets ||
+          s->buckets[b - s->first_bucket].total.records == 0) {
+        continue;
+      }
+      const hba_bucket* k = &s->buckets[b - s->first_bucket];
+      const hba_totals* t = &k->total;
+      double seconds = t->time / 1000000000.0;
+      printf("%-12.3f %-24s %10" PRIu64 " %12" PRIu64 " %14.3f %12.0f %12" PRIu64
+             " %12" PRIu64 " %12" PRIu64 " %12" PRId64 " %10.3f %12.6f\n",
+             (double) (b * bucket_width) / 1000000000.0, logs[i].name,
+             t->records, t->work, ratio(t->work, seconds),
+             ratio(t->time, t->records),
+             hist_percentile(k->hist, BUCKET_HIST_BUCKETS, BUCKET_HIST_SUB_BITS, 50.0),
+             hist_percentile(k->hist, BUCKET_HIST_BUCKETS, BUCKET_HIST_SUB_BITS, 90.0),
+             hist_percentile(k->hist, BUCKET_HIST_BUCKETS, BUCKET_HIST_SUB_BITS, 99.0),
+             t->latency_max, ratio(t->energy, seconds), ratio(t->energy, t->work));
+    }
+  }
+}
+
+// called for each record when merging logs, see merge_logs()
+typedef void (hba_emit_func) (const hba_log* log, int stage,
+                              const hba_record* r,
+                              const char* line, size_t len, void* arg);
+
+/**
+ * Stream all logs merged in shared ID order. Each log is already in SID
+ * order, so this only needs one cursor per log.
+ */
+static void merge_logs(hba_log* logs, int nlogs, hba_emit_func* emit, void* arg) {
+  const char** cur = malloc(nlogs * sizeof(const char*));
+  hba_record* rec = malloc(nlogs * sizeof(hba_record));
+  const char** next = malloc(nlogs * sizeof(const char*));
+  int i;
+  int ok;
+  if (cur == NULL || rec == NULL || next == NULL) {
+    perror("malloc");
+    goto out;
+  }
+  for (i = 0; i < nlogs; i++) {
+    cur[i] = logs[i].body;
+    next[i] = NULL;
+    while (cur[i] < logs[i].end) {
+      next[i] = parse_record(cur[i], logs[i].end, &rec[i], &ok);
+      if (ok) {
+        break;
+      }
+      cur[i] = next[i];
+    }
+  }
+  for (;;) {
+    int min = -1;
+    for (i = 0; i < nlogs; i++) {
+      if (cur[i] < logs[i].end && (min < 0 || rec[i].sid < rec[min].sid)) {
+        min = i;
+      }
+    }
+    if (min < 0) {
+      break;
+    }
+    emit(&logs[min], min, &rec[min], cur[min], (size_t) (next[min] - cur[min]), arg);
+    cur[min] = next[min];
+    while (cur[min] < logs[min].end) {
+      next[min] = parse_record(cur[min], logs[min].end, &rec[min], &ok);
+      if (ok) {
+        break;
+      }
+      cur[min] = next[min];
+    }
+  }
+out:
+  free(next);
+  free(rec);
+  free(cur);
+}
+
+/**
+ * Print a record's line prefixed with its stage.
+ */
+static void join_line(const hba_log* log, int stage, const hba_record* r,
+                      const char* line, size_t len, void* arg) {
+  FILE* out = (FILE*) arg;
+  fprintf(out, "%s    ", log->name);
+  fwrite(line, 1, len, out);
+}
+
+typedef struct {
+  FILE* out;
+  int64_t t0;
+} hba_trace;
+
+static void print_json_string(FILE* out, const char* s, const char* suffix) {
+  fputc('"', out);
+  for (; *s != '\0'; s++) {
+    if (*s == '"' || *s == '\\') {
+      fputc('\\', out);
+      fputc(*s, out);
+    } else if ((unsigned char) *s < 0x20) {
+      fprintf(out, "\\u%04x", (unsigned char) *s);
+    } else {
+      fputc(*s, out);
+    }
+  }
+  fputs(suffix, out);
+  fputc('"', out);
+}
+
+// trace timestamps are in microseconds, relative to the first record
+static void print_trace_time(FILE* out, int64_t ns) {
+  if (ns < 0) {
+    fputc('-', out);
+    ns = -ns;
+  }
+  fprintf(out, "%" PRId64 ".%03d", ns / 1000, (int) (ns % 1000));
+}
+
+/**
+ * Print a record as a complete event spanning the time since the previous
+ * heartbeat (hb_prev's, for pipelined heartbeats), with power and work
+ * counters.
+ */
+static void trace_record(const hba_log* log, int stage, const hba_record* r,
+                         const char* line, size_t len, void* arg) {
+  hba_trace* tr = (hba_trace*) arg;
+  FILE* out = tr->out;
+  int64_t end = r->timestamp - tr->t0;
+  fputs(",\n{\"ph\":\"X\",\"pid\":1,\"tid\":", out);
+  fprintf(out, "%d,\"name\":", stage + 1);
+  print_json_string(out, log->name, "");
+  fputs(",\"ts\":", out);
+  print_trace_time(out, end - r->latency);
+  fputs(",\"dur\":", out);
+  print_trace_time(out, r->latency);
+  fprintf(out, ",\"args\":{\"sid\":%" PRIu64 ",\"work\":%" PRIu64
+          ",\"accuracy\":%f,\"energy\":%f}}", r->sid, r->work, r->accuracy,
+          r->energy);
+  if (r->latency > 0) {
+    fputs(",\n{\"ph\":\"C\",\"pid\":1,\"name\":", out);
+    print_json_string(out, log->name, " power");
+    fputs(",\"ts\":", out);
+    print_trace_time(out, end);
+    fprintf(out, ",\"args\":{\"W\":%f}}",
+            r->energy / (r->latency / 1000000000.0));
+  }
+  fputs(",\n{\"ph\":\"C\",\"pid\":1,\"name\":", out);
+  print_json_string(out, log->name, " work");
+  fputs(",\"ts\":", out);
+  print_trace_time(out, end);
+  fprintf(out, ",\"args\":{\"work\":%" PRIu64 "}}", r->work);
+}
+
+/**
+ * Stream all logs as Chrome trace event JSON (also loaded by Perfetto), one
+ * track per stage. Like join_logs(), memory doesn't grow with log size.
+ */
+static void trace_logs(hba_log* logs, int nlogs, int64_t t0, FILE* out) {
+  hba_trace tr = { out, t0 };
+  int i;
+  fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", out);
+  fputs("{\"ph\":\"M\",\"pid\":1,\"name\":\"process_name\","
+        "\"args\":{\"name\":\"heartbeats\"}}", out);
+  for (i = 0; i < nlogs; i++) {
+    fprintf(out, ",\n{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_name\","
+            "\"args\":{\"name\":", i + 1);
+    print_json_string(out, logs[i].name, "");
+    fprintf(out, "}},\n{\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+            "\"name\":\"thread_sort_index\",\"args\":{\"sort_index\":%d}}",
+            i + 1, i);
+  }
+  merge_logs(logs, nlogs, &trace_record, &tr);
+  fputs("\n]}\n", out);
+}
+
+/**
+ * Stream all logs merged in shared ID order, prefixing each line with its
+ * stage.
+ */
+static void join_logs(hba_log* logs, int nlogs, FILE* out) {
+  merge_logs(logs, nlogs, &join_line, out);
+}
+
+static void usage(const char* prog) {
+  fprintf(stderr, "usage:\n");
+  fprintf(stderr, "  %s [-b bucket_seconds] [-j | -c] [-t threads] <log> [log...]\n", prog);
+  fprintf(stderr, "    -b  also report per time bucket of this many seconds, with coarser\n");
+  fprintf(stderr, "        latency percentiles (within 12.5%%)\n");
+  fprintf(stderr, "    -j  print all records joined in shared ID order instead of statistics\n");
+  fprintf(stderr, "    -c  print all records as Chrome trace events (JSON) instead of statistics\n");
+  fprintf(stderr, "    -t  parser threads (default: online CPUs)\n");
+}
+
+int main(int argc, char** argv) {
+  double bucket_seconds = 0;
+  int join = 0;
+  int trace = 0;
+  long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  int opt;
+  int i;
+  int ret = 0;
+  while ((opt = getopt(argc, argv, "b:jct:h")) != -1) {
+    switch (opt) {
+      case 'b':
+        bucket_seconds = atof(optarg);
+        break;
+      case 'j':
+        join = 1;
+        break;
+      case 'c':
+        trace = 1;
+        break;
+      case 't':
+        nthreads = atol(optarg);
+        break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind >= argc || bucket_seconds < 0 || (join && trace)) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+
+  int nlogs = argc - optind;
+  hba_log* logs = calloc(nlogs, sizeof(hba_log));
+  if (logs == NULL) {
+    perror("calloc");
+    return 1;
+  }
+  for (i = 0; i < nlogs; i++) {
+    if (open_log(&logs[i], argv[optind + i])) {
+      nlogs = i;
+      ret = 1;
+      goto cleanup;
+    }
+    logs[i].name = stage_name(logs[i].name);
+  }
+
+  if (join) {
+    join_logs(logs, nlogs, stdout);
+    goto cleanup;
+  }
+
+  // time buckets are relative to the first record across all logs
+  hba_work_queue q;
+  memset(&q, 0, sizeof(q));
+  q.bucket_width = (int64_t) (bucket_seconds * 1000000000.0);
+  q.t0 = INT64_MAX;
+  for (i = 0; i < nlogs; i++) {
+    hba_record r;
+    int ok;
+    if (logs[i].body < logs[i].end) {
+      parse_record(logs[i].body, logs[i].end, &r, &ok);
+      if (ok && r.timestamp < q.t0) {
+        q.t0 = r.timestamp;
+      }
+    }
+  }
+
+  if (trace) {
+    trace_logs(logs, nlogs, q.t0, stdout);
+    goto cleanup;
+  }
+
+  // split each log into chunks on line boundaries
+  uint64_t chunks = (uint64_t) nthreads * CHUNKS_PER_THREAD;
+  q.tasks = calloc(nlogs * chunks, sizeof(hba_task));
+  if (q.tasks == NULL) {
+    perror("calloc");
+    ret = 1;
+    goto cleanup;
+  }
+  for (i = 0; i < nlogs; i++) {
+    const char* p = logs[i].body;
+    size_t len = (size_t) (logs[i].end - logs[i].body);
+    uint64_t c;
+    for (c = 0; c < chunks && p < logs[i].end; c++) {
+      const char* e = c == chunks - 1 ? logs[i].end : logs[i].body + len / chunks * (c + 1);
+      if (e < p) {
+        e = p;
+      }
+      if (e < logs[i].end) {
+        e = memchr(e, '\n', (size_t) (logs[i].end - e));
+        e = e == NULL ? logs[i].end : e + 1;
+      }
+      q.tasks[q.ntasks].log = &logs[i];
+      q.tasks[q.ntasks].start = p;
+      q.tasks[q.ntasks].end = e;
+      q.ntasks++;
+      p = e;
+    }
+  }
+
+  pthread_t* threads = malloc(nthreads * sizeof(pthread_t));
+  long started = 0;
+  if (threads != NULL) {
+    for (; started < nthreads; started++) {
+      if (pthread_create(&threads[started], NULL, &parse_worker, &q)) {
+        break;
+      }
+    }
+  }
+  if (started == 0) {
+    // parse in this thread
+    parse_worker(&q);
+  }
+  for (i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+
+  uint64_t t;
+  for (t = 0; t < q.ntasks; t++) {
+    if (stats_merge(&q.tasks[t].log->stats, &q.tasks[t].stats)) {
+      perror("realloc");
+      ret = 1;
+    }
+    free(q.tasks[t].stats.buckets);
+  }
+  free(q.tasks);
+
+  printf("%-24s %10s %12s %12s %14s %12s %12s %12s %12s %12s %12s %10s %12s %12s\n",
+         "stage", "records", "work", "time_s", "rate", "lat_mean", "lat_p50",
+         "lat_p90", "lat_p99", "lat_p99.9", "lat_max", "power", "energy",
+         "J/work");
+  for (i = 0; i < nlogs; i++) {
+    print_stage(logs[i].name, &logs[i].stats);
+    if (logs[i].stats.bad_lines > 0) {
+      fprintf(stderr, "%s: skipped %" PRIu64 " malformed lines\n",
+              logs[i].name, logs[i].stats.bad_lines);
+    }
+  }
+  if (q.bucket_width > 0) {
+    print_buckets(logs, nlogs, q.bucket_width);
+  }
+
+cleanup:
+  for (i = 0; i < nlogs; i++) {
+    close_log(&logs[i]);
+  }
+  free(logs);
+  return ret;
+}
@@ -0,0 +1,570 @@
+/**
+ *  Heartbeat overhead benchmarks.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "heartbeat-tree-accuracy-power.h"
+
+static int64_t now_ns(clockid_t clk) {
+  struct timespec ts;
+  clock_gettime(clk, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + (int64_t) ts.tv_nsec;
+}
+
+/**
+ * Time heartbeats with the system clock and with the tick clock at a few
+ * resolutions, and measure how far tick timestamps lag the system clock.
+ */
+static void bench_clock(uint64_t beats) {
+  const int64_t resolutions[] = { 0, 1000, 10000, 100000, 1000000 };
+  const uint64_t error_stride = 64;
+  unsigned int r;
+  uint64_t i;
+  for (r = 0; r < sizeof(resolutions) / sizeof(resolutions[0]); r++) {
+    heartbeat_t* hb = heartbeat_init(NULL, 20, 20, NULL);
+    if (hb == NULL) {
+      exit(1);
+    }
+    if (resolutions[r] > 0 && hb_tick_clock_start(resolutions[r])) {
+      exit(1);
+    }
+
+    // overhead
+    int64_t start = now_ns(CLOCK_MONOTONIC);
+    for (i = 0; i < beats; i++) {
+      heartbeat(hb, i, 1, NULL);
+    }
+    int64_t elapsed = now_ns(CLOCK_MONOTONIC) - start;
+
+    // accuracy - compare returned timestamps against the system clock
+    double err_sum = 0;
+    int64_t err_max = 0;
+    uint64_t samples = 0;
+    for (i = 0; i < beats; i++) {
+      int64_t ts = heartbeat(hb, i, 1, NULL);
+      if (i % error_stride == 0) {
+        int64_t err = now_ns(CLOCK_REALTIME) - ts;
+        err_sum += err;
+        err_max = err > err_max ? err : err_max;
+        samples++;
+      }
+    }
+
+    hb_tick_clock_stop();
+    heartbeat_finish(hb);
+    if (resolutions[r] > 0) {
+      printf("tick %8" PRId64 " ns: ", resolutions[r]);
+    } else {
+      printf("clock_gettime:    ");
+    }
+    printf("%8.2f ns/beat, timestamp error mean %10.1f ns, max %10" PRId64 " ns\n",
+           ((double) elapsed) / beats, samples ? err_sum / samples : 0.0,
+           err_max);
+  }
+}
+
+#define RATE_BEAT_NS   200
+#define RATE_WINDOW_NS 10000000
+#define RATE_RUN_NS    100000000
+
+/**
+ * Check global and window rates stay correct with the tick clock when many
+ * heartbeats share a tick: beats are paced at a known rate and the window
+ * spans at least 10 ticks (and 10 ms, as even a sleeping clock thread can
+ * be delayed that long on a busy machine).
+ */
+static int bench_clock_rates(void) {
+  const int64_t resolutions[] = { 1000, 10000, 100000, 1000000 };
+  int failed = 0;
+  unsigned int r;
+  for (r = 0; r < sizeof(resolutions) / sizeof(resolutions[0]); r++) {
+    if (resolutions[r] < 50000 && sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+      // the spinning clock thread would share a core with the heartbeats
+      printf("tick %8" PRId64 " ns: rate check skipped, needs 2 CPUs\n",
+             resolutions[r]);
+      continue;
+    }
+    int64_t span = 10 * resolutions[r] > RATE_WINDOW_NS ?
+                   10 * resolutions[r] : RATE_WINDOW_NS;
+    uint64_t window = span / RATE_BEAT_NS;
+    uint64_t zero = 0;
+    uint64_t i;
+    int64_t now;
+    heartbeat_t* hb = heartbeat_init(NULL, window, 20, NULL);
+    if (hb == NULL || hb_tick_clock_start(resolutions[r])) {
+      exit(1);
+    }
+    int64_t start = now_ns(CLOCK_MONOTONIC);
+    int64_t last = start;
+    for (i = 0; (now = now_ns(CLOCK_MONOTONIC)) - start < RATE_RUN_NS; i++) {
+      while ((now = now_ns(CLOCK_MONOTONIC)) - last < RATE_BEAT_NS);
+      last = now;
+      heartbeat(hb, i, 1, NULL);
+      // once the window has filled it always spans more than a tick
+      if (i > window && hb_get_window_rate(hb) == 0) {
+        zero++;
+      }
+    }
+    // the first beat only starts the clock
+    double rate = (i - 1) * 1e9 / (last - start);
+    double global_err = fabs(hb_get_global_rate(hb) - rate) / rate;
+    double window_err = fabs(hb_get_window_rate(hb) - rate) / rate;
+    hb_tick_clock_stop();
+    heartbeat_finish(hb);
+    int ok = global_err <= 0.05 && window_err <= 0.2 && zero == 0;
+    failed |= !ok;
+    printf("tick %8" PRId64 " ns: rate error global %5.2f%%, window %5.2f%%, "
+           "%" PRIu64 " zero window rates, %s\n", resolutions[r],
+           global_err * 100, window_err * 100, zero, ok ? "ok" : "FAILED");
+  }
+  return failed;
+}
+
+#define READER_THREADS 3
+#define READER_HISTORY 256
+
+typedef struct {
+  heartbeat_t* hb;
+  volatile int* done;
+  uint64_t reads;
+  uint64_t records;
+  uint64_t torn;
+} reader_arg;
+
+/**
+ * Records are written with user_tag == work == beat number, so a consistent
+ * history is a run of consecutive IDs with matching tags and work.
+ */
+static void* history_reader(void* arg) {
+  reader_arg* ra = (reader_arg*) arg;
+  heartbeat_record_t* history = malloc(READER_HISTORY * sizeof(heartbeat_record_t));
+  heartbeat_record_t current;
+  uint64_t i;
+  uint64_t n;
+  if (history == NULL) {
+    return NULL;
+  }
+  while (!*ra->done) {
+    n = hb_get_history(ra->hb, history, READER_HISTORY);
+    for (i = 0; i < n; i++) {
+      if (history[i].user_tag != history[i].id ||
+          history[i].work != history[i].id ||
+          (i > 0 && history[i].id != history[i - 1].id + 1)) {
+        ra->torn++;
+        break;
+      }
+    }
+    hb_get_current(ra->hb, &current);
+    if (current.user_tag != current.id || current.work != current.id) {
+      ra->torn++;
+    }
+    ra->reads++;
+    ra->records += n;
+  }
+  free(history);
+  return NULL;
+}
+
+/**
+ * Hammer history readers on other threads against a producer and count
+ * inconsistent snapshots (there should be none).
+ */
+static void bench_readers(uint64_t beats) {
+  pthread_t threads[READER_THREADS];
+  reader_arg args[READER_THREADS];
+  volatile int done = 0;
+  int started;
+  int t;
+  uint64_t i;
+  heartbeat_t* hb = heartbeat_init(NULL, 20, READER_HISTORY * 2, NULL);
+  if (hb == NULL) {
+    exit(1);
+  }
+  // make sure there's a full history before readers start checking it
+  for (i = 0; i < READER_HISTORY * 2; i++) {
+    heartbeat(hb, i, i, NULL);
+  }
+  for (started = 0; started < READER_THREADS; started++) {
+    memset(&args[started], 0, sizeof(reader_arg));
+    args[started].hb = hb;
+    args[started].done = &done;
+    if (pthread_create(&threads[started], NULL, &history_reader, &args[started])) {
+      break;
+    }
+  }
+
+  int64_t start = now_ns(CLOCK_MONOTONIC);
+  for (; i < beats + READER_HISTORY * 2; i++) {
+    heartbeat(hb, i, i, NULL);
+  }
+  int64_t elapsed = now_ns(CLOCK_MONOTONIC) - start;
+  done = 1;
+
+  uint64_t reads = 0;
+  uint64_t records = 0;
+  uint64_t torn = 0;
+  for (t = 0; t < started; t++) {
+    pthread_join(threads[t], NULL);
+    reads += args[t].reads;
+    records += args[t].records;
+    torn += args[t].torn;
+  }
+  heartbeat_finish(hb);
+  printf("readers x%d:       %8.2f ns/beat, %" PRIu64 " reads, %.1f records/read, "
+         "%" PRIu64 " inconsistent\n",
+         started, ((double) elapsed) / beats, reads,
+         reads ? ((double) records) / reads : 0.0, torn);
+}
+
+#define BEAT_THREADS 4
+
+typedef struct {
+  heartbeat_t* hb;
+  uint64_t beats;
+  int64_t elapsed;
+} beat_arg;
+
+static void* beat_thread(void* arg) {
+  beat_arg* ba = (beat_arg*) arg;
+  uint64_t i;
+  int64_t start = now_ns(CLOCK_MONOTONIC);
+  for (i = 0; i < ba->beats; i++) {
+    heartbeat(ba->hb, i, 1, NULL);
+  }
+  ba->elapsed = now_ns(CLOCK_MONOTONIC) - start;
+  return NULL;
+}
+
+/**
+ * Heartbeats driven concurrently by separate threads, either as independent
+ * trees or as siblings that share their parent's data.
+ */
+static void bench_threads(uint64_t beats) {
+  pthread_t threads[BEAT_THREADS];
+  beat_arg args[BEAT_THREADS];
+  int siblings;
+  int started;
+  int t;
+  for (siblings = 0; siblings < 2; siblings++) {
+    heartbeat_t* parent = NULL;
+    if (siblings) {
+      parent = heartbeat_init(NULL, 20, 20, NULL);
+      if (parent == NULL) {
+        exit(1);
+      }
+    }
+    for (t = 0; t < BEAT_THREADS; t++) {
+      args[t].hb = heartbeat_init(parent, 20, 20, NULL);
+      args[t].beats = beats;
+      args[t].elapsed = 0;
+      if (args[t].hb == NULL) {
+        exit(1);
+      }
+    }
+    for (started = 0; started < BEAT_THREADS; started++) {
+      if (pthread_create(&threads[started], NULL, &beat_thread, &args[started])) {
+        break;
+      }
+    }
+    double ns = 0;
+    for (t = 0; t < started; t++) {
+      pthread_join(threads[t], NULL);
+      ns += ((double) args[t].elapsed) / beats;
+    }
+    for (t = 0; t < BEAT_THREADS; t++) {
+      heartbeat_finish(args[t].hb);
+    }
+    heartbeat_finish(parent);
+    printf("threads x%d %-8s %8.2f ns/beat per thread\n", started,
+           siblings ? "siblings" : "roots", started ? ns / started : 0.0);
+  }
+}
+
+#define FORMAT_RECORDS 4096
+
+/**
+ * A double with a random exponent, often a short binary fraction so that
+ * rounding ties at the 6th decimal place are exercised too.
+ */
+static double random_double(unsigned int* seed) {
+  double v;
+  switch (rand_r(seed) % 4) {
+  case 0:
+    // dyadic fractions, e.g. k / 2^7 has a tie at the 7th decimal place
+    v = ldexp((double) (rand_r(seed) % 100000), -(rand_r(seed) % 24));
+    break;
+  case 1:
+    v = ldexp((double) rand_r(seed) / RAND_MAX, (rand_r(seed) % 80) - 40);
+    break;
+  case 2:
+    v = (double) rand_r(seed) / RAND_MAX * 1000000.0;
+    break;
+  default:
+    v = 0;
+    break;
+  }
+  return rand_r(seed) % 8 == 0 ? -v : v;
+}
+
+static size_t format_fprintf(const heartbeat_record_t* r, char* buf, size_t size) {
+  // the format the log was previously written with
+  return (size_t) snprintf(buf, size,
+                           "%" PRIu64"    %" PRIu64"    %" PRIu64"    %" PRIu64"    "
+                           "%" PRIu64"    %" PRIu64"    %f    %f    %f    "
+                           "%f    %f    %f    %f    "
+                           "%f    %f    %f    %f\n",
+                           r->id,
+                           r->shared_id,
+                           r->user_tag,
+                           r->timestamp,
+                           r->work,
+                           (uint64_t) r->latency,
+                           r->global_perf,
+                           r->window_perf,
+                           r->instant_perf,
+                           r->accuracy,
+                           r->global_acc,
+                           r->window_acc,
+                           r->instant_acc,
+                           r->energy,
+                           r->global_pwr,
+                           r->window_pwr,
+                           r->instant_pwr);
+}
+
+/**
+ * Compare log formatting throughput against snprintf with the original
+ * format string, and check the output is byte-identical.
+ */
+static void bench_format(uint64_t beats) {
+  heartbeat_record_t* records = calloc(FORMAT_RECORDS, sizeof(heartbeat_record_t));
+  char* buf = malloc(HEARTBEAT_RECORD_TEXT_MAX * 2);
+  char* expected = buf + HEARTBEAT_RECORD_TEXT_MAX;
+  unsigned int seed = 1;
+  uint64_t mismatches = 0;
+  uint64_t i;
+  size_t n;
+  size_t len = 0;
+  if (records == NULL || buf == NULL) {
+    exit(1);
+  }
+  // real records for the integer fields, random values for the doubles
+  heartbeat_t* hb = heartbeat_init(NULL, 20, FORMAT_RECORDS, NULL);
+  if (hb == NULL) {
+    exit(1);
+  }
+  for (i = 0; i < FORMAT_RECORDS; i++) {
+    heartbeat(hb, i * 7919, i % 13, NULL);
+  }
+  n = hb_get_history(hb, records, FORMAT_RECORDS);
+  heartbeat_finish(hb);
+  for (i = 0; i < n; i++) {
+    records[i].global_perf = random_double(&seed);
+    records[i].window_perf = random_double(&seed);
+    records[i].instant_perf = random_double(&seed);
+    records[i].accuracy = random_double(&seed);
+    records[i].global_acc = random_double(&seed);
+    records[i].window_acc = random_double(&seed);
+    records[i].instant_acc = random_double(&seed);
+    records[i].energy = random_double(&seed);
+    records[i].global_pwr = random_double(&seed);
+    records[i].window_pwr = random_double(&seed);
+    records[i].instant_pwr = random_double(&seed);
+  }
+
+  for (i = 0; i < n; i++) {
+    len = hb_format_record(&records[i], buf, HEARTBEAT_RECORD_TEXT_MAX);
+    if (len != format_fprintf(&records[i], expected, HEARTBEAT_RECORD_TEXT_MAX) ||
+        memcmp(buf, expected, len)) {
+      if (mismatches++ == 0) {
+        fprintf(stderr, "mismatch:\n  %.*s  %s", (int) len, buf, expected);
+      }
+    }
+  }
+
+  int64_t start = now_ns(CLOCK_MONOTONIC);
+  for (i = 0; i < beats; i++) {
+    len += format_fprintf(&records[i % n], buf, HEARTBEAT_RECORD_TEXT_MAX);
+  }
+  int64_t printf_ns = now_ns(CLOCK_MONOTONIC) - start;
+  start = now_ns(CLOCK_MONOTONIC);
+  for (i = 0; i < beats; i++) {
+    len += hb_format_record(&records[i % n], buf, HEARTBEAT_RECORD_TEXT_MAX);
+  }
+  int64_t format_ns = now_ns(CLOCK_MONOTONIC) - start;
+
+  printf("format printf:    %12.0f records/s\n", beats * 1e9 / printf_ns);
+  printf("format custom:    %12.0f records/s, %.2fx, %" PRIu64 " mismatches (%zu bytes)\n",
+         beats * 1e9 / format_ns, ((double) printf_ns) / format_ns, mismatches,
+         len);
+  free(buf);
+  free(records);
+}
+
+/**
+ * Place a log buffer on the calling thread's NUMA node and check it's
+ * reported there both before and after the producer writes it.
+ */
+static int bench_numa(uint64_t beats) {
+  unsigned int cpu;
+  unsigned int node;
+  int before;
+  int after;
+  uint64_t i;
+  heartbeat_t* hb = heartbeat_init(NULL, 20, 1024, NULL);
+  if (hb == NULL) {
+    exit(1);
+  }
+  if (syscall(SYS_getcpu, &cpu, &node, NULL) ||
+      hb_set_buffer_node(hb, (int) node)) {
+    printf("numa:             skipped, can't bind the buffer\n");
+    heartbeat_finish(hb);
+    return 0;
+  }
+  before = hb_get_buffer_node(hb);
+  for (i = 0; i < beats; i++) {
+    heartbeat(hb, i, 1, NULL);
+  }
+  after = hb_get_buffer_node(hb);
+  heartbeat_finish(hb);
+  printf("numa node %u:      before writes %d, after writes %d, %s\n", node,
+         before, after, before == (int) node && after == (int) node ? "ok" : "FAILED");
+  return before != (int) node || after != (int) node;
+}
+
+#define CONTROL_WINDOW   20
+#define CONTROL_WINDOWS  60
+#define CONTROL_SETTLE   20
+#define CONTROL_BEAT_NS  20000
+
+/*
+ * A simulated plant whose rate is proportional to the knob: 1e6 work units
+ * per second per knob unit, drawing 2 W per knob unit.
+ */
+typedef struct {
+  double knob;
+  int64_t last;
+  double energy;
+} plant;
+
+static long long plant_energy(void* arg) {
+  plant* p = (plant*) arg;
+  int64_t now = now_ns(CLOCK_REALTIME);
+  if (p->last > 0) {
+    // W * ns = nJ, reported in uJ
+    p->energy += p->knob * 2.0 * (now - p->last) / 1000.0;
+  }
+  p->last = now;
+  return (long long) p->energy;
+}
+
+/**
+ * Run the built-in controller in a loop with the plant and return the worst
+ * window rate error (relative to the target) and window power after it
+ * settles.
+ */
+static void run_plant(double cap, double target, double* error, double* power) {
+  plant p = { 2, 0, 0 };
+  int64_t last;
+  int64_t now;
+  uint64_t work;
+  uint64_t i;
+  double e;
+  heartbeat_t* hb = heartbeat_acc_pow_init(NULL, CONTROL_WINDOW, CONTROL_WINDOW,
+                                           NULL, &plant_energy, &p);
+  if (hb == NULL) {
+    exit(1);
+  }
+  hb_set_target_rate(hb, target * 0.95, target * 1.05);
+  hb_set_power_cap(hb, cap);
+  hb_set_controller(hb, 1, 16, p.knob, 0);
+  *error = 0;
+  *power = 0;
+  last = now_ns(CLOCK_REALTIME);
+  for (i = 0; i < CONTROL_WINDOW * CONTROL_WINDOWS; i++) {
+    // the work the plant did at the current knob since the last beat
+    while ((now = now_ns(CLOCK_REALTIME)) - last < CONTROL_BEAT_NS);
+    work = (uint64_t) (p.knob * 1e6 * (now - last) / 1e9 + 0.5);
+    last = now;
+    heartbeat(hb, i, work, NULL);
+    p.knob = hb_get_knob(hb);
+    if (i % CONTROL_WINDOW == CONTROL_WINDOW - 1 &&
+        i >= CONTROL_WINDOW * CONTROL_SETTLE) {
+      e = fabs(hb_get_window_rate(hb) - target) / target;
+      *error = e > *error ? e : *error;
+      *power = hb_get_window_power(hb) > *power ? hb_get_window_power(hb) : *power;
+    }
+  }
+  heartbeat_finish(hb);
+}
+
+/**
+ * Check the built-in controller settles at the target rate of a simulated
+ * plant, and that it stays under a power cap that rules out the target.
+ */
+static int bench_control(void) {
+  double error;
+  double power;
+  int failed = 0;
+  int ok;
+  // knob 8 hits the target at 16 W
+  run_plant(0, 8e6, &error, &power);
+  ok = error <= 0.1;
+  failed |= !ok;
+  printf("control target:   %6.2f%% max error after settling, %s\n",
+         error * 100, ok ? "ok" : "FAILED");
+  // a 10 W cap limits the knob to 5
+  run_plant(10, 8e6, &error, &power);
+  ok = power <= 10 * 1.05;
+  failed |= !ok;
+  printf("control cap:      %6.2f W max power after settling (cap 10 W), %s\n",
+         power, ok ? "ok" : "FAILED");
+  return failed;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    printf("usage:\n");
+    printf("  %s <beats> [clock|readers|threads|format|numa|control]\n", argv[0]);
+    return -1;
+  }
+
+  const uint64_t beats = strtoull(argv[1], NULL, 0);
+  const char* which = argc > 2 ? argv[2] : NULL;
+  int failed = 0;
+  if (beats == 0) {
+    fprintf(stderr, "beats must be > 0\n");
+    return -1;
+  }
+
+  if (which == NULL || !strcmp(which, "clock")) {
+    bench_clock(beats);
+    failed |= bench_clock_rates();
+  }
+  if (which == NULL || !strcmp(which, "readers")) {
+    bench_readers(beats);
+  }
+  if (which == NULL || !strcmp(which, "threads")) {
+    bench_threads(beats);
+  }
+  if (which == NULL || !strcmp(which, "format")) {
+    bench_format(beats);
+  }
+  if (which == NULL || !strcmp(which, "numa")) {
+    failed |= bench_numa(beats);
+  }
+  if (which == NULL || !strcmp(which, "control")) {
+    failed |= bench_control();
+  }
+  return failed;
+}
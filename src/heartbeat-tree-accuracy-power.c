@@ -3,11 +3,27 @@
  *
  * @author Connor Imes
  */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
 #include <stdio.h>
 #include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "heartbeat-tree-accuracy-power.h"
 
 #define __STDC_FORMAT_MACROS
@@ -16,6 +32,115 @@
   #define HEARTBEAT_ACCURACY_DEFAULT 0.0
 #endif
 
+#ifndef HEARTBEAT_HUGE_PAGE_THRESHOLD
+  #define HEARTBEAT_HUGE_PAGE_THRESHOLD (2 * 1024 * 1024)
+#endif
+
+// from <numaif.h>, without requiring libnuma
+#ifndef MPOL_PREFERRED
+  #define MPOL_PREFERRED 1
+#endif
+#ifndef MPOL_BIND
+  #define MPOL_BIND 2
+#endif
+#ifndef MPOL_F_NODE
+  #define MPOL_F_NODE (1 << 0)
+#endif
+#ifndef MPOL_F_ADDR
+  #define MPOL_F_ADDR (1 << 1)
+#endif
+#ifndef MPOL_MF_MOVE
+  #define MPOL_MF_MOVE (1 << 1)
+#endif
+
+// controller process and measurement noise, relative to the speed estimate
+#ifndef HEARTBEAT_CONTROL_Q
+  #define HEARTBEAT_CONTROL_Q 0.1
+#endif
+#ifndef HEARTBEAT_CONTROL_R
+  #define HEARTBEAT_CONTROL_R 0.2
+#endif
+
+// smallest standard deviation for phase detection, relative to the mean
+#ifndef HEARTBEAT_PHASE_MIN_DEVIATION
+  #define HEARTBEAT_PHASE_MIN_DEVIATION 0.01
+#endif
+
+#define HEARTBEAT_STATE_MAGIC   0x54534248 // "HBST"
+#define HEARTBEAT_STATE_VERSION 3
+
+/*
+ * State file layout: a header followed by a ring of window_size + 1
+ * records, where the record with local id i is in slot
+ * i % (window_size + 1). The header keeps two copies of the totals, written
+ * alternately, so a crash while one is being updated leaves the other. The
+ * spare record slot means writing the next record never overwrites one that
+ * the other copy still needs.
+ */
+typedef struct {
+  // odd while being updated
+  uint64_t seq;
+  uint64_t counter;
+  uint64_t shared_counter;
+  int64_t total_time;
+  int64_t total_active;
+  uint64_t total_work;
+  int64_t total_cpu_time;
+  double total_accuracy;
+  double total_energy;
+  double domain_total_energy[HEARTBEAT_ENERGY_DOMAINS_MAX];
+  _heartbeat_correction_data cr;
+} hb_state_totals;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t domain_count;
+  uint64_t window_size;
+  // the copy for counter c is totals[c & 1]
+  hb_state_totals totals[2];
+} hb_state_header;
+
+#define HEARTBEAT_STATE_HEADER_SIZE \
+  ((sizeof(hb_state_header) + HEARTBEAT_CACHE_LINE_SIZE - 1) & \
+   ~((size_t) HEARTBEAT_CACHE_LINE_SIZE - 1))
+
+// log text is written in chunks of at most this many bytes
+#ifndef HEARTBEAT_LOG_CHUNK_SIZE
+  #define HEARTBEAT_LOG_CHUNK_SIZE (256 * 1024)
+#endif
+
+#ifndef HEARTBEAT_HISTORY_BLOCK_RECORDS
+  #define HEARTBEAT_HISTORY_BLOCK_RECORDS 256
+#endif
+
+#ifndef HEARTBEAT_TICK_SPIN_THRESHOLD
+  #define HEARTBEAT_TICK_SPIN_THRESHOLD 50000
+#endif
+
+// how long to wait for another process to initialize a shared segment (ns)
+#ifndef HEARTBEAT_SHARED_TIMEOUT
+  #define HEARTBEAT_SHARED_TIMEOUT 1000000000
+#endif
+
+/*
+ * Coarse-grained clock maintained by a background thread.
+ * The timestamp is read on every heartbeat by every thread, so it gets its
+ * own cache line; it is 0 while the clock thread is not running.
+ */
+static struct {
+  int64_t now;
+  char pad[HEARTBEAT_CACHE_LINE_SIZE - sizeof(int64_t)];
+} hb_tick HEARTBEAT_CACHE_ALIGNED;
+
+static struct {
+  pthread_mutex_t mutex;
+  pthread_t thread;
+  int64_t resolution;
+  int running;
+} hb_tick_ctl = { PTHREAD_MUTEX_INITIALIZER };
+
 static inline void init_time_data(_heartbeat_time_data* td) {
   td->last_timestamp = -1;
   td->total_time = 0;
@@ -27,41 +152,245 @@ static inline void init_work_data(_heartbeat_work_data* td) {
   td->window_work = 0;
 }
 
+static inline void init_span_data(_heartbeat_span_data* sn) {
+  sn->begin = -1;
+  sn->active = 0;
+  sn->spans = 0;
+  sn->total_active = 0;
+  sn->window_active = 0;
+}
+
+static inline void init_cpu_data(_heartbeat_cpu_data* cd) {
+  cd->flags = 0;
+  cd->last_cpu_time = 0;
+  cd->total_cpu_time = 0;
+  cd->window_cpu_time = 0;
+  cd->last_vcsw = 0;
+  cd->last_ivcsw = 0;
+}
+
+static inline void init_sampling_data(_heartbeat_sampling_data* sp) {
+  sp->interval = 0;
+  sp->period = 0;
+  sp->budget = 0;
+  sp->min_interval = 0;
+  sp->last_time = -1;
+  sp->pending = 0;
+  sp->check_mask = 0;
+  sp->beats = 0;
+  sp->pending_work = 0;
+  sp->pending_accuracy = 0;
+}
+
 static inline void init_accuracy_data(_heartbeat_accuracy_data* ad) {
   ad->total_accuracy = 0;
   ad->window_accuracy = 0;
 }
 
 static inline void init_energy_data(_heartbeat_energy_data* ed) {
+  unsigned int d;
   ed->last_energy = 0;
+  ed->last_change = -1;
   ed->total_energy = 0;
   ed->window_energy = 0;
+  ed->range = 0;
+  ed->max_power = 0;
+  for (d = 0; d < HEARTBEAT_ENERGY_DOMAINS_MAX; d++) {
+    ed->domain_range[d] = 0;
+    ed->domain_last_energy[d] = 0;
+    ed->domain_last_change[d] = -1;
+    ed->domain_total_energy[d] = 0;
+    ed->domain_window_energy[d] = 0;
+  }
+}
+
+extern char** environ;
+
+static const char hb_log_header[] =
+  "LID    SID    Tag    Timestamp    "
+  "Work    Latency    Global_Perf    Window_Perf    Instant_Perf    "
+  "Accuracy    Global_Acc    Window_Acc    Instant_Acc    "
+  "Energy    Global_Pwr    Window_Pwr    Instant_Pwr\n";
+
+/**
+ * Write to the log file, bypassing stdio.
+ */
+static void hb_write_log(_heartbeat_local_data* ld, const char* buf, size_t len) {
+  ssize_t ret;
+  int fd = fileno(ld->text_file);
+  while (len > 0) {
+    ret = write(fd, buf, len);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("Failed to write heartbeat log");
+      return;
+    }
+    buf += ret;
+    len -= ret;
+    ld->lr.bytes += ret;
+  }
+}
+
+static inline void init_log_rotation_data(_heartbeat_log_rotation_data* lr) {
+  lr->log_name = NULL;
+  lr->max_bytes = 0;
+  lr->max_age = 0;
+  lr->segments = 0;
+  lr->compress = 0;
+  lr->open_time = -1;
+  lr->bytes = 0;
+  lr->compress_pid = -1;
+}
+
+static inline void init_bounds(_heartbeat_bounds* b) {
+  b->enabled = 0;
+  b->state = 0;
+  b->min = 0;
+  b->max = 0;
+}
+
+static inline void init_event_data(_heartbeat_event_data* ev) {
+  ev->enabled = 0;
+  ev->delivery = HEARTBEAT_EVENT_INLINE;
+  ev->func = NULL;
+  ev->arg = NULL;
+  ev->window_count = 0;
+  init_bounds(&ev->perf);
+  init_bounds(&ev->acc);
+  init_bounds(&ev->pwr);
+  ev->queue = NULL;
+  ev->queue_size = 0;
+  ev->head = 0;
+  ev->dropped = 0;
+  ev->fd = -1;
+  ev->running = 0;
+  ev->tail = 0;
+}
+
+static inline void init_correction_data(_heartbeat_correction_data* cr) {
+  cr->time_steps = 0;
+  cr->energy_wraps = 0;
+  cr->energy_outliers = 0;
+}
+
+static inline void init_control_data(_heartbeat_control_data* ct) {
+  ct->enabled = 0;
+  ct->min_rate = -INFINITY;
+  ct->max_rate = INFINITY;
+  ct->power_cap = 0;
+  ct->knob = 0;
+  ct->knob_min = 0;
+  ct->knob_max = 0;
+  ct->pole = 0;
+  ct->window_count = 0;
+  ct->speed = 0;
+  ct->speed_var = 0;
+}
+
+static inline void init_cusum(_heartbeat_cusum* c) {
+  c->n = 0;
+  c->mean = 0;
+  c->m2 = 0;
+  c->pos = 0;
+  c->neg = 0;
+  c->pos_id = 0;
+  c->neg_id = 0;
+}
+
+static inline void init_phase_data(_heartbeat_phase_data* ph) {
+  ph->enabled = 0;
+  ph->changed = 0;
+  ph->threshold = 0;
+  ph->drift = 0;
+  ph->min_beats = 0;
+  init_cusum(&ph->perf);
+  init_cusum(&ph->pwr);
+  ph->count = 0;
+}
+
+static inline size_t hb_buffer_size(uint64_t buffer_depth) {
+  size_t page = (size_t) sysconf(_SC_PAGESIZE);
+  size_t size = buffer_depth * sizeof(_heartbeat_record_t);
+  return (size + page - 1) / page * page;
+}
+
+/**
+ * Log buffers are mapped directly rather than malloc'd so they start out
+ * zeroed without being touched - pages are then placed on the node of the
+ * thread that issues the heartbeats (or per hb_set_buffer_node()) - and so
+ * large buffers can use transparent huge pages.
+ */
+static _heartbeat_record_t* hb_alloc_buffer(uint64_t buffer_depth) {
+  size_t size = hb_buffer_size(buffer_depth);
+  void* buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED) {
+    return NULL;
+  }
+#ifdef MADV_HUGEPAGE
+  if (size >= HEARTBEAT_HUGE_PAGE_THRESHOLD) {
+    // only a hint, failure is harmless
+    madvise(buf, size, MADV_HUGEPAGE);
+  }
+#endif
+  return (_heartbeat_record_t*) buf;
+}
+
+static void hb_free_buffer(_heartbeat_record_t* buf, uint64_t buffer_depth) {
+  if (buf != NULL) {
+    munmap(buf, hb_buffer_size(buffer_depth));
+  }
 }
 
 static inline int init_local_data(_heartbeat_local_data* ld,
+                                  uint64_t window_size,
                                   uint64_t buffer_depth,
                                   const char* log_name,
                                   hb_get_energy_func* ef,
                                   void* ref_arg) {
   ld->valid = 0;
   ld->counter = 0;
+  ld->seq = 0;
   ld->ef = ef;
   ld->ref_arg = ref_arg;
+  ld->domain_count = 0;
   ld->buffer_depth = buffer_depth;
+  ld->state_map = NULL;
+  ld->state_size = 0;
+  ld->hs = NULL;
   ld->buffer_index = 0;
   ld->read_index = 0;
+  ld->first_id = 0;
+  ld->window_index = 0;
   init_time_data(&ld->td);
   init_work_data(&ld->wd);
+  init_span_data(&ld->sn);
+  init_cpu_data(&ld->cd);
+  init_sampling_data(&ld->sp);
   init_accuracy_data(&ld->ad);
   init_energy_data(&ld->ed);
+  init_log_rotation_data(&ld->lr);
+  init_correction_data(&ld->cr);
+  init_control_data(&ld->ct);
+  ld->ru.count = 0;
+  init_phase_data(&ld->ph);
+
+  // allocate window ring
+  // initial values are 0 (necessary until there are window_size records)
+  ld->window = calloc(window_size, sizeof(_heartbeat_window_entry));
+  if (ld->window == NULL) {
+    perror("Failed to allocate heartbeat window");
+    return 1;
+  }
 
   // allocate log buffer
-  ld->log = malloc(buffer_depth * sizeof(_heartbeat_record_t));
+  ld->log = hb_alloc_buffer(buffer_depth);
   if (ld->log == NULL) {
+    perror("Failed to allocate heartbeat log buffer");
     return 1;
   }
-  // set initial values to 0 (necessary for managing window data)
-  memset(ld->log, 0, buffer_depth * sizeof(_heartbeat_record_t));
 
   // open log file
   if (log_name != NULL) {
@@ -69,40 +398,249 @@ static inline int init_local_data(_heartbeat_local_data* ld,
     if (ld->text_file == NULL) {
       perror("Failed to open heartbeat log file");
       // cleanup log buffer
-      free(ld->log);
+      hb_free_buffer(ld->log, buffer_depth);
+      ld->log = NULL;
+      return 1;
+    }
+    // keep the name for log rotation
+    ld->lr.log_name = strdup(log_name);
+    ld->text_buf = malloc(HEARTBEAT_LOG_CHUNK_SIZE);
+    if (ld->lr.log_name == NULL || ld->text_buf == NULL) {
+      perror("Failed to allocate heartbeat log file data");
+      free(ld->lr.log_name);
+      ld->lr.log_name = NULL;
+      free(ld->text_buf);
+      ld->text_buf = NULL;
+      fclose(ld->text_file);
+      ld->text_file = NULL;
+      hb_free_buffer(ld->log, buffer_depth);
       ld->log = NULL;
       return 1;
     }
-    fprintf(ld->text_file,
-            "LID    SID    Tag    Timestamp    "
-            "Work    Latency    Global_Perf    Window_Perf    Instant_Perf    "
-            "Accuracy    Global_Acc    Window_Acc    Instant_Acc    "
-            "Energy    Global_Pwr    Window_Pwr    Instant_Pwr\n");
+    hb_write_log(ld, hb_log_header, sizeof(hb_log_header) - 1);
   }
   return 0;
 }
 
-static inline void init_shared_data(_heartbeat_shared_data* sd) {
+static inline int init_shared_data(_heartbeat_shared_data* sd, int pshared) {
   sd->valid = 0;
   sd->counter = 0;
+  sd->pshared = (char) pshared;
+  sd->ready = 0;
+  sd->td.last_timestamp = 0;
+  sd->td.total_time = 0;
+  sd->td.window_time = 0;
+#ifdef HEARTBEAT_USE_PTHREADS_LOCK
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  if (pshared) {
+    // other processes may die while holding the lock
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  }
+  errno = pthread_mutex_init(&sd->mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+  if (errno) {
+    perror("Failed to initialize heartbeat shared data mutex");
+    return 1;
+  }
+#else
+  (void) pshared;
+#endif
+  return 0;
+}
+
 #ifdef HEARTBEAT_USE_PTHREADS_LOCK
-  pthread_mutex_init(&sd->mutex, NULL);
+static inline void hb_lock(_heartbeat_shared_data* sd) {
+  if (pthread_mutex_lock(&sd->mutex) == EOWNERDEAD) {
+    // a process died holding the lock, the shared data is still usable
+    pthread_mutex_consistent(&sd->mutex);
+  }
+}
 #endif
+
+/**
+ * Create or attach to shared data in a named shared memory segment.
+ */
+static inline int64_t hb_monotonic_time(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + (int64_t) ts.tv_nsec;
 }
 
-heartbeat_t* heartbeat_acc_pow_init(heartbeat_t* parent,
-                                    uint64_t window_size,
-                                    uint64_t buffer_depth,
-                                    const char* log_name,
-                                    hb_get_energy_func* read_energy_func,
-                                    void* ref_arg) {
-  if (buffer_depth < window_size) {
-    fprintf(stderr, "Buffer depth must be >= window size\n");
+/**
+ * Returns non-zero if fd is still the segment named shm_name, i.e. it wasn't
+ * unlinked (and maybe recreated) by another process since it was opened.
+ */
+static int hb_shared_current(int fd, const char* shm_name) {
+  struct stat st;
+  struct stat named;
+  int ret;
+  int named_fd = shm_open(shm_name, O_RDONLY, 0);
+  if (named_fd < 0) {
+    return 0;
+  }
+  ret = !fstat(fd, &st) && !fstat(named_fd, &named) &&
+        st.st_dev == named.st_dev && st.st_ino == named.st_ino;
+  close(named_fd);
+  return ret;
+}
+
+/*
+ * Every process attached to a segment holds a shared flock() on it for as
+ * long as it's attached; the kernel drops it if the process dies. The last
+ * to detach takes the lock exclusively and unlinks the segment while holding
+ * it, and a segment nobody holds a lock on was left by processes that died,
+ * so it's unlinked and recreated. Attachers check after locking that the
+ * name still refers to their segment, else they start over.
+ */
+static _heartbeat_shared_data* hb_attach_shared(const char* shm_name,
+                                                int* shm_fd) {
+  _heartbeat_shared_data* sd;
+  struct stat st;
+  int64_t deadline;
+  unsigned int attempts;
+  int created;
+  int fd;
+
+  for (attempts = 0; attempts < 100; attempts++) {
+    created = 1;
+    fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+      created = 0;
+      fd = shm_open(shm_name, O_RDWR, 0600);
+      if (fd < 0 && errno == ENOENT) {
+        // removed in the meantime
+        continue;
+      }
+    }
+    if (fd < 0) {
+      perror("Failed to open heartbeat shared memory");
+      return NULL;
+    }
+    if (!created && flock(fd, LOCK_EX | LOCK_NB) == 0) {
+      // nobody is attached, it's stale
+      if (hb_shared_current(fd, shm_name)) {
+        shm_unlink(shm_name);
+      }
+      close(fd);
+      continue;
+    }
+    if (flock(fd, LOCK_SH)) {
+      perror("Failed to lock heartbeat shared memory");
+      close(fd);
+      return NULL;
+    }
+    if (!hb_shared_current(fd, shm_name)) {
+      close(fd);
+      continue;
+    }
+    break;
+  }
+  if (attempts == 100) {
+    fprintf(stderr, "Failed to attach heartbeat shared memory: %s\n", shm_name);
     return NULL;
   }
 
-  heartbeat_t* hb = malloc(sizeof(heartbeat_t));
-  if (hb == NULL) {
+  // the name can't be unlinked by others while we hold the lock
+  deadline = hb_monotonic_time() + HEARTBEAT_SHARED_TIMEOUT;
+  if (created) {
+    if (ftruncate(fd, sizeof(_heartbeat_shared_data))) {
+      perror("Failed to size heartbeat shared memory");
+      shm_unlink(shm_name);
+      close(fd);
+      return NULL;
+    }
+  } else {
+    // the creator may not have sized it yet
+    for (;;) {
+      if (fstat(fd, &st)) {
+        perror("Failed to stat heartbeat shared memory");
+        close(fd);
+        return NULL;
+      }
+      if (st.st_size >= (off_t) sizeof(_heartbeat_shared_data)) {
+        break;
+      }
+      if (hb_monotonic_time() > deadline) {
+        fprintf(stderr, "Timed out waiting for heartbeat shared memory: %s\n",
+                shm_name);
+        close(fd);
+        return NULL;
+      }
+      sched_yield();
+    }
+  }
+  sd = mmap(NULL, sizeof(_heartbeat_shared_data), PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+  if (sd == MAP_FAILED) {
+    perror("Failed to map heartbeat shared memory");
+    if (created) {
+      shm_unlink(shm_name);
+    }
+    close(fd);
+    return NULL;
+  }
+  if (created) {
+    if (init_shared_data(sd, 1)) {
+      munmap(sd, sizeof(_heartbeat_shared_data));
+      shm_unlink(shm_name);
+      close(fd);
+      return NULL;
+    }
+    __atomic_store_n(&sd->ready, 1, __ATOMIC_RELEASE);
+  } else {
+    while (!__atomic_load_n(&sd->ready, __ATOMIC_ACQUIRE)) {
+      if (hb_monotonic_time() > deadline) {
+        // e.g. the creator died, the next attach after we let go reclaims it
+        fprintf(stderr, "Timed out waiting for heartbeat shared memory: %s\n",
+                shm_name);
+        munmap(sd, sizeof(_heartbeat_shared_data));
+        close(fd);
+        return NULL;
+      }
+      sched_yield();
+    }
+  }
+  *shm_fd = fd;
+  return sd;
+}
+
+/**
+ * Detach from shared memory, removing the segment after the last user.
+ */
+static void hb_detach_shared(_heartbeat_shared_data* sd,
+                             const char* shm_name,
+                             int shm_fd) {
+  munmap(sd, sizeof(_heartbeat_shared_data));
+  flock(shm_fd, LOCK_UN);
+  // held until closed, so nobody attaches while it's being removed
+  if (flock(shm_fd, LOCK_EX | LOCK_NB) == 0) {
+    shm_unlink(shm_name);
+  }
+  close(shm_fd);
+}
+
+static heartbeat_t* hb_init(heartbeat_t* parent,
+                            const char* shm_name,
+                            uint64_t window_size,
+                            uint64_t buffer_depth,
+                            const char* log_name,
+                            hb_get_energy_func* read_energy_func,
+                            void* ref_arg) {
+  if (window_size == 0) {
+    fprintf(stderr, "Window size must be > 0\n");
+    return NULL;
+  }
+  // the newest record is always kept for readers, even if not logging
+  if (buffer_depth == 0) {
+    buffer_depth = 1;
+  }
+
+  heartbeat_t* hb;
+  errno = posix_memalign((void**) &hb, HEARTBEAT_CACHE_LINE_SIZE,
+                         sizeof(heartbeat_t));
+  if (errno) {
     perror("Failed to malloc heartbeat");
     return NULL;
   }
@@ -112,27 +650,56 @@ heartbeat_t* heartbeat_acc_pow_init(heartbeat_t* parent,
 
   // initialize to null in case we have to cleanup
   hb->ld.log = NULL;
+  hb->ld.window = NULL;
   hb->ld.text_file = NULL;
+  hb->ld.text_buf = NULL;
+  hb->ld.lr.log_name = NULL;
+  hb->ld.lr.compress_pid = -1;
+  hb->ld.state_map = NULL;
+  hb->ld.hs = NULL;
+  hb->ld.ru.count = 0;
+  init_event_data(&hb->ld.ev);
   hb->sd = NULL;
+  hb->shm_name = NULL;
+  hb->shm_fd = -1;
 
   // allocate or point to existing shared data
-  if (hb->parent == NULL) {
-    // allocate shared data
-    hb->sd = malloc(sizeof(_heartbeat_shared_data));
+  if (shm_name != NULL) {
+    hb->shm_name = strdup(shm_name);
+    if (hb->shm_name == NULL) {
+      perror("Failed to copy heartbeat shared memory name");
+      heartbeat_finish(hb);
+      return NULL;
+    }
+    hb->sd = hb_attach_shared(shm_name, &hb->shm_fd);
     if (hb->sd == NULL) {
+      heartbeat_finish(hb);
+      return NULL;
+    }
+  } else if (hb->parent == NULL) {
+    // allocate shared data
+    errno = posix_memalign((void**) &hb->sd, HEARTBEAT_CACHE_LINE_SIZE,
+                           sizeof(_heartbeat_shared_data));
+    if (errno) {
+      hb->sd = NULL;
       perror("Failed to malloc heartbeat shared data");
       heartbeat_finish(hb);
       return NULL;
     }
-    init_shared_data(hb->sd);
+    if (init_shared_data(hb->sd, 0)) {
+      free(hb->sd);
+      hb->sd = NULL;
+      heartbeat_finish(hb);
+      return NULL;
+    }
   } else {
     // point to parent's shared data
     hb->sd = hb->parent->sd;
   }
 
   // local data
-  if (init_local_data(&hb->ld, buffer_depth, log_name, read_energy_func,
-                      ref_arg)) {
+  if (init_local_data(&hb->ld, window_size, buffer_depth, log_name,
+                      read_energy_func, ref_arg)) {
     heartbeat_finish(hb);
     return NULL;
   }
@@ -140,6 +707,64 @@ heartbeat_t* heartbeat_acc_pow_init(heartbeat_t* parent,
   return hb;
 }
 
+heartbeat_t* heartbeat_acc_pow_init(heartbeat_t* parent,
+                                    uint64_t window_size,
+                                    uint64_t buffer_depth,
+                                    const char* log_name,
+                                    hb_get_energy_func* read_energy_func,
+                                    void* ref_arg) {
+  return hb_init(parent, NULL, window_size, buffer_depth, log_name,
+                 read_energy_func, ref_arg);
+}
+
+heartbeat_t* heartbeat_acc_pow_init_shared(const char* shm_name,
+                                           uint64_t window_size,
+                                           uint64_t buffer_depth,
+                                           const char* log_name,
+                                           hb_get_energy_func* read_energy_func,
+                                           void* ref_arg) {
+  if (shm_name == NULL) {
+    fprintf(stderr, "Shared heartbeat requires a shared memory name\n");
+    return NULL;
+  }
+  return hb_init(NULL, shm_name, window_size, buffer_depth, log_name,
+                 read_energy_func, ref_arg);
+}
+
+heartbeat_t* heartbeat_acc_init_shared(const char* shm_name,
+                                       uint64_t window_size,
+                                       uint64_t buffer_depth,
+                                       const char* log_name) {
+  return heartbeat_acc_pow_init_shared(shm_name, window_size, buffer_depth,
+                                       log_name, NULL, NULL);
+}
+
+heartbeat_t* heartbeat_init_shared(const char* shm_name,
+                                   uint64_t window_size,
+                                   uint64_t buffer_depth,
+                                   const char* log_name) {
+  return heartbeat_acc_pow_init_shared(shm_name, window_size, buffer_depth,
+                                       log_name, NULL, NULL);
+}
+
+heartbeat_t* heartbeat_init_restore(heartbeat_t* parent,
+                                    uint64_t window_size,
+                                    uint64_t buffer_depth,
+                                    const char* log_name,
+                                    const char* state_name) {
+  heartbeat_t* hb = heartbeat_init(parent, window_size, buffer_depth, log_name);
+  if (hb == NULL) {
+    return NULL;
+  }
+  // a missing or unusable state file just means starting fresh
+  hb_restore_state(hb, state_name);
+  if (hb_set_state_file(hb, state_name)) {
+    heartbeat_finish(hb);
+    return NULL;
+  }
+  return hb;
+}
+
 heartbeat_t* heartbeat_acc_init(heartbeat_t* parent,
                                 uint64_t window_size,
                                 uint64_t buffer_depth,
@@ -156,197 +781,2615 @@ heartbeat_t* heartbeat_init(heartbeat_t* parent,
                                 NULL, NULL);
 }
 
+int hb_set_log_rotation(heartbeat_t* hb,
+                        uint64_t max_bytes,
+                        int64_t max_age,
+                        unsigned int segments,
+                        int compress) {
+  if (hb->ld.lr.log_name == NULL) {
+    fprintf(stderr, "Heartbeat log rotation requires a log file\n");
+    return -1;
+  }
+  hb->ld.lr.max_bytes = max_bytes;
+  hb->ld.lr.max_age = max_age;
+  hb->ld.lr.segments = segments;
+  hb->ld.lr.compress = compress;
+  return 0;
+}
+
 /**
- * Write log to file.
+ * Wait for a previous segment compression to finish.
  */
-static void hb_flush_buffer(heartbeat_t* hb) {
-  uint64_t i;
-  if (hb->ld.text_file != NULL) {
-    for (i = 0; i < hb->ld.buffer_index; i++) {
-      fprintf(hb->ld.text_file,
-              "%" PRIu64"    %" PRIu64"    %" PRIu64"    %" PRIu64"    "
-              "%" PRIu64"    %" PRIu64"    %f    %f    %f    "
-              "%f    %f    %f    %f    "
-              "%f    %f    %f    %f\n",
-              hb->ld.log[i].id,
-              hb->ld.log[i].shared_id,
-              hb->ld.log[i].user_tag,
-              hb->ld.log[i].timestamp,
-
-              hb->ld.log[i].work,
-              hb->ld.log[i].latency,
-              hb->ld.log[i].global_perf,
-              hb->ld.log[i].window_perf,
-              hb->ld.log[i].instant_perf,
-
-              hb->ld.log[i].accuracy,
-              hb->ld.log[i].global_acc,
-              hb->ld.log[i].window_acc,
-              hb->ld.log[i].instant_acc,
-
-              hb->ld.log[i].energy,
-              hb->ld.log[i].global_pwr,
-              hb->ld.log[i].window_pwr,
-              hb->ld.log[i].instant_pwr);
-    }
-    fflush(hb->ld.text_file);
+static void hb_wait_compress(_heartbeat_log_rotation_data* lr) {
+  if (lr->compress_pid > 0) {
+    while (waitpid(lr->compress_pid, NULL, 0) < 0 && errno == EINTR);
+    lr->compress_pid = -1;
   }
 }
 
-void heartbeat_finish(heartbeat_t* hb) {
-  if (hb != NULL) {
-    if (hb->parent == NULL && hb->sd != NULL) {
-#ifdef HEARTBEAT_USE_PTHREADS_LOCK
-      pthread_mutex_destroy(&hb->sd->mutex);
-#endif
-      free(hb->sd);
-    }
-    // cleanup local data
-    if (hb->ld.text_file != NULL) {
-      hb_flush_buffer(hb);
-      fclose(hb->ld.text_file);
-    }
-    free(hb->ld.log);
-    free(hb);
+/**
+ * Returns non-zero while a previous segment compression is running, reaping
+ * it without waiting once it's done.
+ */
+static int hb_compressing(_heartbeat_log_rotation_data* lr) {
+  pid_t ret;
+  if (lr->compress_pid <= 0) {
+    return 0;
   }
+  while ((ret = waitpid(lr->compress_pid, NULL, WNOHANG)) < 0 && errno == EINTR);
+  if (ret == 0) {
+    return 1;
+  }
+  // done, or already reaped elsewhere (e.g. SIGCHLD is ignored)
+  lr->compress_pid = -1;
+  return 0;
 }
 
-static inline void set_window_values(heartbeat_t* hb,
-                                     int64_t latency_change,
-                                     uint64_t work,
-                                     double accuracy,
-                                     double energy_change) {
-  // get the index for the data we're going to drop from the window
-  // we enforce buffer_size >= window_size for this purpose
-  uint64_t idx;
-  if (hb->window_size > hb->ld.buffer_index) {
-    idx = hb->ld.buffer_depth + hb->ld.buffer_index - hb->window_size;
+/**
+ * Open the log file, with mode "w" to start a new one or "a" to continue
+ * whatever is there. Returns 0 on success.
+ */
+static int hb_open_log(heartbeat_t* hb, const char* mode) {
+  struct stat st;
+  hb->ld.lr.open_time = -1;
+  hb->ld.lr.bytes = 0;
+  hb->ld.text_file = fopen(hb->ld.lr.log_name, mode);
+  if (hb->ld.text_file == NULL) {
+    return -1;
+  }
+  if (fstat(fileno(hb->ld.text_file), &st) == 0 && st.st_size > 0) {
+    hb->ld.lr.bytes = (uint64_t) st.st_size;
   } else {
-    idx = hb->ld.buffer_index - hb->window_size;
+    hb_write_log(&hb->ld, hb_log_header, sizeof(hb_log_header) - 1);
   }
-  // now update the running window values
-  // if we haven't yet reached window_size heartbeats, the log values are 0
-  hb->ld.td.window_time += latency_change - hb->ld.log[idx].latency;
-  hb->ld.wd.window_work += work - hb->ld.log[idx].work;
-  hb->ld.ad.window_accuracy += accuracy - hb->ld.log[idx].accuracy;
-  hb->ld.ed.window_energy += energy_change - hb->ld.log[idx].energy;
+  return 0;
 }
 
-static inline void process_heartbeat(heartbeat_t* hb,
-                                     uint64_t user_tag,
-                                     uint64_t work,
-                                     double accuracy,
-                                     int64_t time,
-                                     double energy) {
-  int64_t latency_change;
-  double energy_change;
+/**
+ * Returns non-zero if either variant of a segment exists.
+ */
+static int hb_segment_exists(const char* name) {
+  char name_gz[PATH_MAX + 4];
+  snprintf(name_gz, sizeof(name_gz), "%s.gz", name);
+  return access(name, F_OK) == 0 || access(name_gz, F_OK) == 0;
+}
 
-  // update shared data
-  hb->sd->counter++;
-  if (hb->sd->valid == 0) {
-    hb->sd->valid = 1;
-  } else {
-    hb->sd->td.total_time += time - hb->sd->td.last_timestamp;
+/**
+ * Rename whichever of a segment's plain or compressed variants exists,
+ * replacing both variants of to. A missing segment isn't an error.
+ * Returns 0 on success.
+ */
+static int hb_move_segment(const char* from, const char* to) {
+  char from_gz[PATH_MAX + 4];
+  char to_gz[PATH_MAX + 4];
+  snprintf(from_gz, sizeof(from_gz), "%s.gz", from);
+  snprintf(to_gz, sizeof(to_gz), "%s.gz", to);
+  if (rename(from, to) == 0) {
+    unlink(to_gz);
+  } else if (errno != ENOENT) {
+    return -1;
+  } else if (rename(from_gz, to_gz) == 0) {
+    unlink(to);
+  } else if (errno != ENOENT) {
+    return -1;
   }
-  hb->sd->td.last_timestamp = time;
+  return 0;
+}
 
-  // update local data
-  if (hb->ld.valid == 0) {
-    hb->ld.valid = 1;
-    latency_change = 0;
-    energy_change = 0;
-    accuracy = 0;
-    work = 0;
-  } else {
-    latency_change = time - hb->ld.td.last_timestamp;
-    energy_change = energy - hb->ld.ed.last_energy;
-    hb->ld.td.total_time += latency_change;
-    hb->ld.wd.total_work += work;
-    hb->ld.ad.total_accuracy += accuracy;
-    hb->ld.ed.total_energy += energy - hb->ld.ed.last_energy;
+/**
+ * Start a new log file, keeping at most the configured number of old ones.
+ * Segments must not be renamed while one is being compressed, so callers
+ * check hb_compressing() first. If a segment can't be renamed, the current
+ * log is kept open and rotation is retried at the next flush. Segments are
+ * only shifted up to the first free slot, so a retry doesn't shift (and
+ * drop) them again.
+ */
+static void hb_rotate_log(heartbeat_t* hb) {
+  _heartbeat_log_rotation_data* lr = &hb->ld.lr;
+  char from[PATH_MAX];
+  char to[PATH_MAX];
+  unsigned int i;
+
+  if (lr->segments > 0) {
+    // without a free slot, shifting overwrites the oldest segment
+    for (i = 1; i < lr->segments; i++) {
+      snprintf(to, sizeof(to), "%s.%u", lr->log_name, i);
+      if (!hb_segment_exists(to)) {
+        break;
+      }
+    }
+    for (; i > 1; i--) {
+      snprintf(from, sizeof(from), "%s.%u", lr->log_name, i - 1);
+      snprintf(to, sizeof(to), "%s.%u", lr->log_name, i);
+      if (hb_move_segment(from, to)) {
+        perror("Failed to rotate heartbeat log segment");
+        return;
+      }
+    }
+    snprintf(to, sizeof(to), "%s.1", lr->log_name);
+    if (hb_move_segment(lr->log_name, to)) {
+      perror("Failed to rotate heartbeat log");
+      return;
+    }
   }
-  set_window_values(hb, latency_change, work, accuracy, energy_change);
-  hb->ld.td.last_timestamp = time;
-  hb->ld.ed.last_energy = energy;
-  hb->ld.counter++;
-  hb->ld.read_index = hb->ld.buffer_index;
-  uint64_t index = hb->ld.buffer_index;
-  hb->ld.buffer_index++;
 
-  // now store in log
+  fclose(hb->ld.text_file);
+  hb->ld.text_file = NULL;
+  if (lr->segments == 0) {
+    unlink(lr->log_name);
+  } else if (lr->compress) {
+    char* argv[] = { "gzip", "-f", to, NULL };
+    if (posix_spawnp(&lr->compress_pid, "gzip", NULL, NULL, argv, environ)) {
+      perror("Failed to compress rotated heartbeat log");
+      lr->compress_pid = -1;
+    }
+  }
+
+  if (hb_open_log(hb, "w")) {
+    // retried at each flush, see hb_flush_buffer()
+    perror("Failed to open rotated heartbeat log file");
+  }
+}
+
+int hb_set_buffer_node(heartbeat_t* hb, int node) {
+  unsigned long nodemask[16];
+  unsigned int cpu;
+  unsigned int cpu_node;
+  if (node < 0) {
+    if (syscall(SYS_getcpu, &cpu, &cpu_node, NULL)) {
+      perror("Failed to get the calling thread's NUMA node");
+      return -1;
+    }
+    node = (int) cpu_node;
+  }
+  if ((size_t) node >= sizeof(nodemask) * 8) {
+    fprintf(stderr, "Invalid NUMA node: %d\n", node);
+    return -1;
+  }
+  memset(nodemask, 0, sizeof(nodemask));
+  nodemask[node / (sizeof(unsigned long) * 8)] |= 1UL << (node % (sizeof(unsigned long) * 8));
+  // move any pages that were already touched
+  if (syscall(SYS_mbind, hb->ld.log, hb_buffer_size(hb->ld.buffer_depth),
+              MPOL_PREFERRED, nodemask, sizeof(nodemask) * 8, MPOL_MF_MOVE)) {
+    perror("Failed to bind heartbeat log buffer");
+    return -1;
+  }
+  return 0;
+}
+
+int hb_get_buffer_node(const heartbeat_t* hb) {
+  unsigned long nodemask[16];
+  void* page = hb->ld.log;
+  int status = -1;
+  int mode;
+  unsigned int i;
+  // without target nodes, move_pages() only reports where pages are
+  if (syscall(SYS_move_pages, 0, 1UL, &page, NULL, &status, 0) == 0 &&
+      status >= 0) {
+    return status;
+  }
+  // not written yet (reads only map the shared zero page, which says
+  // nothing about the buffer), so report where it will be placed
+  if (syscall(SYS_get_mempolicy, &mode, nodemask, sizeof(nodemask) * 8, page,
+              MPOL_F_ADDR)) {
+    return -1;
+  }
+  // the low bits are the mode, the rest are flags
+  mode &= 0xff;
+  if (mode != MPOL_PREFERRED && mode != MPOL_BIND) {
+    return -1;
+  }
+  for (i = 0; i < sizeof(nodemask) * 8; i++) {
+    if (nodemask[i / (sizeof(unsigned long) * 8)] & (1UL << (i % (sizeof(unsigned long) * 8)))) {
+      return (int) i;
+    }
+  }
+  return -1;
+}
+
+static inline _heartbeat_record_t* hb_state_records(hb_state_header* h) {
+  return (_heartbeat_record_t*) ((char*) h + HEARTBEAT_STATE_HEADER_SIZE);
+}
+
+static inline uint64_t hb_state_size(uint64_t window_size) {
+  return HEARTBEAT_STATE_HEADER_SIZE +
+         (window_size + 1) * sizeof(_heartbeat_record_t);
+}
+
+static void hb_write_state_totals(const heartbeat_t* hb, hb_state_totals* t) {
+  t->counter = hb->ld.counter;
+  t->shared_counter = hb->sd->counter;
+  t->total_time = hb->ld.td.total_time;
+  t->total_active = hb->ld.sn.total_active;
+  t->total_work = hb->ld.wd.total_work;
+  t->total_cpu_time = hb->ld.cd.total_cpu_time;
+  t->total_accuracy = hb->ld.ad.total_accuracy;
+  t->total_energy = hb->ld.ed.total_energy;
+  memcpy(t->domain_total_energy, hb->ld.ed.domain_total_energy,
+         sizeof(t->domain_total_energy));
+  t->cr = hb->ld.cr;
+}
+
+/**
+ * Write a full snapshot into a zeroed state mapping.
+ * Records in the window but no longer in the log buffer are rebuilt from the
+ * window ring, with only the values that contribute to window totals.
+ */
+static void hb_write_state(const heartbeat_t* hb, hb_state_header* h) {
+  _heartbeat_record_t* records = hb_state_records(h);
+  _heartbeat_record_t* r;
+  const _heartbeat_window_entry* w;
+  uint64_t index = hb->ld.buffer_index;
+  uint64_t slot = hb->ld.window_index;
+  uint64_t id;
+  uint64_t i;
+  h->magic = HEARTBEAT_STATE_MAGIC;
+  h->version = HEARTBEAT_STATE_VERSION;
+  h->record_size = sizeof(_heartbeat_record_t);
+  h->domain_count = hb->ld.domain_count;
+  h->window_size = hb->window_size;
+  // both copies start out the same
+  hb_write_state_totals(hb, &h->totals[0]);
+  hb_write_state_totals(hb, &h->totals[1]);
+  // walk back from the newest record, stopping at any gap left by a restore
+  for (i = 0; i < hb->window_size && i < hb->ld.counter - hb->ld.first_id; i++) {
+    index = index == 0 ? hb->ld.buffer_depth - 1 : index - 1;
+    slot = slot == 0 ? hb->window_size - 1 : slot - 1;
+    id = hb->ld.counter - 1 - i;
+    r = &records[id % (hb->window_size + 1)];
+    if (i < hb->ld.buffer_depth && hb->ld.log[index].id == id) {
+      *r = hb->ld.log[index];
+      continue;
+    }
+    w = &hb->ld.window[slot];
+    r->id = id;
+    r->latency = w->latency;
+    r->active = w->active;
+    r->work = w->work;
+    r->cpu_time = w->cpu_time;
+    r->accuracy = w->accuracy;
+    r->energy = w->energy;
+    memcpy(r->domain_energy, w->domain_energy, sizeof(r->domain_energy));
+  }
+}
+
+/**
+ * Write a snapshot to a temporary file and rename it over state_name, so the
+ * previous file is intact until the new one is complete. Returns the new
+ * file's mapping, or NULL on failure.
+ */
+static hb_state_header* hb_create_state(const heartbeat_t* hb,
+                                        const char* state_name,
+                                        uint64_t size) {
+  char tmp_name[PATH_MAX + 4];
+  hb_state_header* h;
+  int fd;
+  snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", state_name);
+  fd = open(tmp_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror("Failed to open heartbeat state file");
+    return NULL;
+  }
+  if (ftruncate(fd, size)) {
+    perror("Failed to size heartbeat state file");
+    close(fd);
+    unlink(tmp_name);
+    return NULL;
+  }
+  h = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (h == MAP_FAILED) {
+    perror("Failed to map heartbeat state file");
+    unlink(tmp_name);
+    return NULL;
+  }
+  hb_write_state(hb, h);
+  if (msync(h, size, MS_SYNC)) {
+    perror("Failed to write heartbeat state file");
+    munmap(h, size);
+    unlink(tmp_name);
+    return NULL;
+  }
+  if (rename(tmp_name, state_name)) {
+    perror("Failed to replace heartbeat state file");
+    munmap(h, size);
+    unlink(tmp_name);
+    return NULL;
+  }
+  return h;
+}
+
+int hb_save_state(const heartbeat_t* hb, const char* state_name) {
+  uint64_t size = hb_state_size(hb->window_size);
+  hb_state_header* h = hb_create_state(hb, state_name, size);
+  if (h == NULL) {
+    return -1;
+  }
+  munmap(h, size);
+  return 0;
+}
+
+int hb_restore_state(heartbeat_t* hb, const char* state_name) {
+  const hb_state_header* h;
+  const hb_state_totals* t;
+  const _heartbeat_record_t* records;
+  const _heartbeat_record_t* r;
+  _heartbeat_record_t* log = hb->ld.log;
+  _heartbeat_window_entry* w;
+  struct stat st;
+  uint64_t depth = hb->ld.buffer_depth;
+  uint64_t n;
+  uint64_t i;
+  unsigned int d;
+  int fd;
+
+  if (hb->ld.counter > 0) {
+    fprintf(stderr, "Heartbeat state must be restored before the first heartbeat\n");
+    return -1;
+  }
+  fd = open(state_name, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  if (fstat(fd, &st) || st.st_size < (off_t) HEARTBEAT_STATE_HEADER_SIZE) {
+    fprintf(stderr, "Invalid heartbeat state file: %s\n", state_name);
+    close(fd);
+    return -1;
+  }
+  h = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (h == MAP_FAILED) {
+    perror("Failed to map heartbeat state file");
+    return -1;
+  }
+  if (h->magic != HEARTBEAT_STATE_MAGIC || h->version != HEARTBEAT_STATE_VERSION ||
+      h->record_size != sizeof(_heartbeat_record_t) || h->window_size == 0 ||
+      (uint64_t) st.st_size < hb_state_size(h->window_size)) {
+    fprintf(stderr, "Invalid heartbeat state file: %s\n", state_name);
+    munmap((void*) h, st.st_size);
+    return -1;
+  }
+  // a crash during an update leaves that copy's seq odd, use the other
+  t = &h->totals[0];
+  if ((t->seq & 1) ||
+      (!(h->totals[1].seq & 1) && h->totals[1].counter > t->counter)) {
+    t = &h->totals[1];
+  }
+  if (t->seq & 1) {
+    fprintf(stderr, "Invalid heartbeat state file: %s\n", state_name);
+    munmap((void*) h, st.st_size);
+    return -1;
+  }
+  records = hb_state_records((hb_state_header*) h);
+
+  hb->ld.counter = t->counter;
+  hb->ld.td.total_time = t->total_time;
+  hb->ld.sn.total_active = t->total_active;
+  hb->ld.wd.total_work = t->total_work;
+  hb->ld.cd.total_cpu_time = t->total_cpu_time;
+  hb->ld.ad.total_accuracy = t->total_accuracy;
+  hb->ld.ed.total_energy = t->total_energy;
+  for (d = 0; d < hb->ld.domain_count && d < h->domain_count; d++) {
+    hb->ld.ed.domain_total_energy[d] = t->domain_total_energy[d];
+  }
+  hb->ld.cr = t->cr;
+  if (hb->sd->counter < t->shared_counter) {
+    hb->sd->counter = t->shared_counter;
+  }
+
+  // newest records go at the end of the window ring, so that the next
+  // heartbeats evict the oldest first, and of the log buffer, so that they
+  // can be read but are never flushed to the log again
+  n = t->counter < h->window_size ? t->counter : h->window_size;
+  n = n < hb->window_size ? n : hb->window_size;
+  for (i = 0; i < n; i++) {
+    r = &records[(t->counter - 1 - i) % (h->window_size + 1)];
+    if (r->id != t->counter - 1 - i) {
+      break;
+    }
+    if (i < depth) {
+      log[depth - 1 - i] = *r;
+    }
+    w = &hb->ld.window[hb->window_size - 1 - i];
+    w->latency = r->latency;
+    w->active = r->active;
+    w->work = r->work;
+    w->cpu_time = r->cpu_time;
+    w->accuracy = r->accuracy;
+    w->energy = r->energy;
+    hb->ld.td.window_time += r->latency;
+    hb->ld.sn.window_active += r->active;
+    hb->ld.wd.window_work += r->work;
+    hb->ld.cd.window_cpu_time += r->cpu_time;
+    hb->ld.ad.window_accuracy += r->accuracy;
+    hb->ld.ed.window_energy += r->energy;
+    for (d = 0; d < hb->ld.domain_count && d < h->domain_count; d++) {
+      hb->ld.ed.domain_window_energy[d] += r->domain_energy[d];
+      w->domain_energy[d] = r->domain_energy[d];
+    }
+  }
+  hb->ld.first_id = t->counter - i;
+  hb->ld.buffer_index = 0;
+  hb->ld.window_index = 0;
+  hb->ld.read_index = depth - 1;
+  munmap((void*) h, st.st_size);
+  return 0;
+}
+
+int hb_set_state_file(heartbeat_t* hb, const char* state_name) {
+  uint64_t size = hb_state_size(hb->window_size);
+  // a file just restored from is only replaced once the new one is complete
+  hb_state_header* h = hb_create_state(hb, state_name, size);
+  if (h == NULL) {
+    return -1;
+  }
+  if (hb->ld.state_map != NULL) {
+    munmap(hb->ld.state_map, hb->ld.state_size);
+  }
+  hb->ld.state_map = h;
+  hb->ld.state_size = size;
+  return 0;
+}
+
+/**
+ * Update the mapped state file with a new record. The record goes in the
+ * spare ring slot first, then the totals copy that the previous update
+ * didn't write, so a crash at any point leaves one consistent copy.
+ */
+static inline void hb_sync_state(heartbeat_t* hb, uint64_t index) {
+  hb_state_header* h = (hb_state_header*) hb->ld.state_map;
+  hb_state_totals* t = &h->totals[hb->ld.counter & 1];
+  hb_state_records(h)[(hb->ld.counter - 1) % (hb->window_size + 1)] =
+    hb->ld.log[index];
+  __atomic_store_n(&t->seq, t->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  hb_write_state_totals(hb, t);
+  __atomic_store_n(&t->seq, t->seq + 1, __ATOMIC_RELEASE);
+}
+
+static const char hb_digit_pairs[] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+static inline char* hb_format_u64(char* p, uint64_t v) {
+  char tmp[20];
+  char* t = tmp + sizeof(tmp);
+  while (v >= 100) {
+    t -= 2;
+    memcpy(t, &hb_digit_pairs[(v % 100) * 2], 2);
+    v /= 100;
+  }
+  if (v >= 10) {
+    t -= 2;
+    memcpy(t, &hb_digit_pairs[v * 2], 2);
+  } else {
+    *--t = (char) ('0' + v);
+  }
+  memcpy(p, t, tmp + sizeof(tmp) - t);
+  return p + (tmp + sizeof(tmp) - t);
+}
+
+/**
+ * Same output as printf's "%f": the exact binary value rounded to 6 decimal
+ * places, ties to even. Magnitudes that don't fit the integer part in 64 bits
+ * (and inf/nan) fall back to snprintf.
+ */
+static inline char* hb_format_double(char* p, double v) {
+  uint64_t ip;
+  uint64_t frac = 0;
+  double f;
+  double m;
+  int e;
+  int i;
+  if (!isfinite(v) || fabs(v) >= 18446744073709551616.0) {
+    return p + snprintf(p, HEARTBEAT_RECORD_TEXT_MAX, "%f", v);
+  }
+  if (signbit(v)) {
+    *p++ = '-';
+    v = -v;
+  }
+  ip = (uint64_t) v;
+  // exact, and nonzero only if v < 2^53
+  f = v - (double) ip;
+  if (f != 0) {
+    m = frexp(f, &e);
+    // below 2^-21, f * 10^6 can't round up
+    if (e >= -21) {
+      // f = mant * 2^-shift exactly, and mant * 10^6 < 2^73
+      uint64_t mant = (uint64_t) ldexp(m, 53);
+      int shift = 53 - e;
+      unsigned __int128 x = (unsigned __int128) mant * 1000000;
+      unsigned __int128 half = (unsigned __int128) 1 << (shift - 1);
+      unsigned __int128 rem = x & ((half << 1) - 1);
+      frac = (uint64_t) (x >> shift);
+      if (rem > half || (rem == half && (frac & 1))) {
+        frac++;
+      }
+      if (frac == 1000000) {
+        frac = 0;
+        ip++;
+      }
+    }
+  }
+  p = hb_format_u64(p, ip);
+  *p = '.';
+  for (i = 3; i > 0; i--) {
+    memcpy(p + i * 2 - 1, &hb_digit_pairs[(frac % 100) * 2], 2);
+    frac /= 100;
+  }
+  return p + 7;
+}
+
+static inline char* hb_format_sep(char* p) {
+  memcpy(p, "    ", 4);
+  return p + 4;
+}
+
+/**
+ * Format a record into a buffer of at least HEARTBEAT_RECORD_TEXT_MAX bytes.
+ */
+static inline size_t hb_format_record_unchecked(const heartbeat_record_t* hbr,
+                                                char* buf) {
+  char* p = buf;
+  p = hb_format_sep(hb_format_u64(p, hbr->id));
+  p = hb_format_sep(hb_format_u64(p, hbr->shared_id));
+  p = hb_format_sep(hb_format_u64(p, hbr->user_tag));
+  p = hb_format_sep(hb_format_u64(p, hbr->timestamp));
+
+  p = hb_format_sep(hb_format_u64(p, hbr->work));
+  p = hb_format_sep(hb_format_u64(p, (uint64_t) hbr->latency));
+  p = hb_format_sep(hb_format_double(p, hbr->global_perf));
+  p = hb_format_sep(hb_format_double(p, hbr->window_perf));
+  p = hb_format_sep(hb_format_double(p, hbr->instant_perf));
+
+  p = hb_format_sep(hb_format_double(p, hbr->accuracy));
+  p = hb_format_sep(hb_format_double(p, hbr->global_acc));
+  p = hb_format_sep(hb_format_double(p, hbr->window_acc));
+  p = hb_format_sep(hb_format_double(p, hbr->instant_acc));
+
+  p = hb_format_sep(hb_format_double(p, hbr->energy));
+  p = hb_format_sep(hb_format_double(p, hbr->global_pwr));
+  p = hb_format_sep(hb_format_double(p, hbr->window_pwr));
+  p = hb_format_double(p, hbr->instant_pwr);
+  *p++ = '\n';
+  return p - buf;
+}
+
+size_t hb_format_record(const heartbeat_record_t* hbr, char* buf, size_t size) {
+  char tmp[HEARTBEAT_RECORD_TEXT_MAX];
+  size_t len;
+  if (size >= HEARTBEAT_RECORD_TEXT_MAX) {
+    return hb_format_record_unchecked(hbr, buf);
+  }
+  len = hb_format_record_unchecked(hbr, tmp);
+  if (len > size) {
+    return 0;
+  }
+  memcpy(buf, tmp, len);
+  return len;
+}
+
+/**
+ * Write log to file.
+ */
+static void hb_flush_buffer(heartbeat_t* hb) {
+  uint64_t i;
+  size_t len = 0;
+  if (hb->ld.text_file == NULL && hb->ld.lr.log_name != NULL) {
+    // opening a rotated log failed, records until it succeeds are dropped
+    hb_open_log(hb, "a");
+  }
+  if (hb->ld.text_file != NULL) {
+    // render as much of the buffer as fits in a chunk per write
+    for (i = 0; i < hb->ld.buffer_index; i++) {
+      if (HEARTBEAT_LOG_CHUNK_SIZE - len < HEARTBEAT_RECORD_TEXT_MAX) {
+        hb_write_log(&hb->ld, hb->ld.text_buf, len);
+        len = 0;
+      }
+      len += hb_format_record_unchecked(&hb->ld.log[i], hb->ld.text_buf + len);
+    }
+    hb_write_log(&hb->ld, hb->ld.text_buf, len);
+    if (hb->ld.buffer_index > 0) {
+      if (hb->ld.lr.open_time < 0) {
+        hb->ld.lr.open_time = hb->ld.log[0].timestamp;
+      }
+      // rotation is deferred while the last segment is still compressing
+      if (((hb->ld.lr.max_bytes > 0 && hb->ld.lr.bytes >= hb->ld.lr.max_bytes) ||
+           (hb->ld.lr.max_age > 0 &&
+            (int64_t) hb->ld.log[hb->ld.buffer_index - 1].timestamp -
+            hb->ld.lr.open_time >= hb->ld.lr.max_age)) &&
+          !hb_compressing(&hb->ld.lr)) {
+        hb_rotate_log(hb);
+      }
+    }
+  }
+}
+
+int hb_get_event_fd(const heartbeat_t* hb) {
+  return hb->ld.ev.fd;
+}
+
+uint64_t hb_get_dropped_events(const heartbeat_t* hb) {
+  return hb->ld.ev.dropped;
+}
+
+int hb_next_event(heartbeat_t* hb,
+                  int* events,
+                  heartbeat_record_t* record) {
+  _heartbeat_event_data* ev = &hb->ld.ev;
+  _heartbeat_event* slot;
+  if (ev->tail == __atomic_load_n(&ev->head, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+  slot = &ev->queue[ev->tail % ev->queue_size];
+  *events = slot->events;
+  memcpy(record, &slot->record, sizeof(heartbeat_record_t));
+  __atomic_store_n(&ev->tail, ev->tail + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+static void* hb_event_dispatcher(void* arg) {
+  heartbeat_t* hb = (heartbeat_t*) arg;
+  _heartbeat_event_data* ev = &hb->ld.ev;
+  heartbeat_record_t record;
+  uint64_t count;
+  int events;
+  while (__atomic_load_n(&ev->running, __ATOMIC_ACQUIRE)) {
+    if (read(ev->fd, &count, sizeof(count)) < 0 && errno != EINTR) {
+      perror("Failed to wait for heartbeat events");
+      break;
+    }
+    while (hb_next_event(hb, &events, &record)) {
+      ev->func(hb, events, &record, ev->arg);
+    }
+  }
+  // deliver anything left
+  while (hb_next_event(hb, &events, &record)) {
+    ev->func(hb, events, &record, ev->arg);
+  }
+  return NULL;
+}
+
+static void hb_stop_events(heartbeat_t* hb) {
+  _heartbeat_event_data* ev = &hb->ld.ev;
+  const uint64_t one = 1;
+  ev->enabled = 0;
+  if (ev->running) {
+    __atomic_store_n(&ev->running, 0, __ATOMIC_RELEASE);
+    if (write(ev->fd, &one, sizeof(one)) < 0) {
+      perror("Failed to wake heartbeat event dispatcher");
+    }
+    pthread_join(ev->thread, NULL);
+  }
+  if (ev->fd >= 0) {
+    close(ev->fd);
+    ev->fd = -1;
+  }
+  free(ev->queue);
+  ev->queue = NULL;
+  ev->queue_size = 0;
+  ev->head = 0;
+  ev->tail = 0;
+}
+
+int hb_set_event_handler(heartbeat_t* hb,
+                         hb_event_func* func,
+                         void* arg,
+                         int delivery,
+                         uint64_t queue_size) {
+  _heartbeat_event_data* ev = &hb->ld.ev;
+  hb_stop_events(hb);
+  if (func == NULL && delivery != HEARTBEAT_EVENT_NOTIFY) {
+    return 0;
+  }
+  if (delivery != HEARTBEAT_EVENT_INLINE && queue_size == 0) {
+    fprintf(stderr, "Deferred heartbeat events require a queue\n");
+    return -1;
+  }
+  ev->delivery = delivery;
+  ev->func = func;
+  ev->arg = arg;
+  ev->window_count = 0;
+  if (delivery != HEARTBEAT_EVENT_INLINE) {
+    ev->queue = malloc(queue_size * sizeof(_heartbeat_event));
+    if (ev->queue == NULL) {
+      perror("Failed to allocate heartbeat event queue");
+      return -1;
+    }
+    ev->queue_size = queue_size;
+    ev->fd = eventfd(0, EFD_CLOEXEC |
+                        (delivery == HEARTBEAT_EVENT_NOTIFY ? EFD_NONBLOCK : 0));
+    if (ev->fd < 0) {
+      perror("Failed to create heartbeat eventfd");
+      hb_stop_events(hb);
+      return -1;
+    }
+    if (delivery == HEARTBEAT_EVENT_DEFERRED) {
+      ev->running = 1;
+      if (pthread_create(&ev->thread, NULL, &hb_event_dispatcher, hb)) {
+        perror("Failed to create heartbeat event dispatcher");
+        ev->running = 0;
+        hb_stop_events(hb);
+        return -1;
+      }
+    }
+  }
+  ev->enabled = 1;
+  return 0;
+}
+
+static inline void set_bounds(_heartbeat_bounds* b, double min, double max) {
+  b->enabled = 1;
+  b->state = 0;
+  b->min = min;
+  b->max = max;
+}
+
+void hb_set_perf_bounds(heartbeat_t* hb, double min, double max) {
+  set_bounds(&hb->ld.ev.perf, min, max);
+}
+
+void hb_set_accuracy_bounds(heartbeat_t* hb, double min, double max) {
+  set_bounds(&hb->ld.ev.acc, min, max);
+}
+
+void hb_set_power_bounds(heartbeat_t* hb, double min, double max) {
+  set_bounds(&hb->ld.ev.pwr, min, max);
+}
+
+/**
+ * Returns the event raised if value crossed the bounds, or 0.
+ */
+static inline int check_bounds(_heartbeat_bounds* b,
+                               double value,
+                               int low,
+                               int high,
+                               int normal) {
+  int state;
+  if (!b->enabled) {
+    return 0;
+  }
+  state = value < b->min ? -1 : (value > b->max ? 1 : 0);
+  if (state == b->state) {
+    return 0;
+  }
+  b->state = state;
+  return state < 0 ? low : (state > 0 ? high : normal);
+}
+
+static inline void hb_check_events(heartbeat_t* hb,
+                                   const _heartbeat_record_t* record) {
+  _heartbeat_event_data* ev = &hb->ld.ev;
+  const uint64_t one = 1;
+  int events = 0;
+  if (++ev->window_count >= hb->window_size) {
+    events |= HEARTBEAT_EVENT_WINDOW;
+    ev->window_count = 0;
+  }
+  if (hb->ld.counter >= hb->window_size) {
+    events |= check_bounds(&ev->perf, record->window_perf,
+                           HEARTBEAT_EVENT_PERF_LOW, HEARTBEAT_EVENT_PERF_HIGH,
+                           HEARTBEAT_EVENT_PERF_NORMAL);
+    events |= check_bounds(&ev->acc, record->window_acc,
+                           HEARTBEAT_EVENT_ACC_LOW, HEARTBEAT_EVENT_ACC_HIGH,
+                           HEARTBEAT_EVENT_ACC_NORMAL);
+    events |= check_bounds(&ev->pwr, record->window_pwr,
+                           HEARTBEAT_EVENT_PWR_LOW, HEARTBEAT_EVENT_PWR_HIGH,
+                           HEARTBEAT_EVENT_PWR_NORMAL);
+  }
+  if (hb->ld.ph.changed) {
+    events |= HEARTBEAT_EVENT_PHASE;
+  }
+  if (events == 0) {
+    return;
+  }
+  if (ev->delivery == HEARTBEAT_EVENT_INLINE) {
+    ev->func(hb, events, record, ev->arg);
+    return;
+  }
+  if (ev->head - __atomic_load_n(&ev->tail, __ATOMIC_ACQUIRE) >= ev->queue_size) {
+    ev->dropped++;
+    return;
+  }
+  _heartbeat_event* slot = &ev->queue[ev->head % ev->queue_size];
+  slot->events = events;
+  memcpy(&slot->record, record, sizeof(_heartbeat_record_t));
+  __atomic_store_n(&ev->head, ev->head + 1, __ATOMIC_RELEASE);
+  if (write(ev->fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    perror("Failed to signal heartbeat event");
+  }
+}
+
+void hb_set_target_rate(heartbeat_t* hb, double min, double max) {
+  hb->ld.ct.min_rate = min;
+  hb->ld.ct.max_rate = max;
+}
+
+int hb_add_energy_domain(heartbeat_t* hb,
+                         const char* name,
+                         hb_get_energy_func* read_energy_func,
+                         void* ref_arg) {
+  unsigned int d = hb->ld.domain_count;
+  if (read_energy_func == NULL) {
+    fprintf(stderr, "Energy domain requires an energy function\n");
+    return -1;
+  }
+  if (d >= HEARTBEAT_ENERGY_DOMAINS_MAX) {
+    fprintf(stderr, "Too many energy domains, max is %d\n",
+            HEARTBEAT_ENERGY_DOMAINS_MAX);
+    return -1;
+  }
+  snprintf(hb->ld.domains[d].name, HEARTBEAT_ENERGY_DOMAIN_NAME_MAX, "%s",
+           name == NULL ? "" : name);
+  hb->ld.domains[d].ef = read_energy_func;
+  hb->ld.domains[d].ref_arg = ref_arg;
+  // start from the current reading so the first delta isn't the raw counter
+  hb->ld.ed.domain_last_energy[d] = read_energy_func(ref_arg) / 1000000.0;
+  hb->ld.domain_count = d + 1;
+  return (int) d;
+}
+
+void hb_set_energy_range(heartbeat_t* hb, double range) {
+  hb->ld.ed.range = range / 1000000.0;
+}
+
+int hb_set_energy_domain_range(heartbeat_t* hb,
+                               unsigned int domain,
+                               double range) {
+  if (domain >= hb->ld.domain_count) {
+    fprintf(stderr, "No energy domain %u\n", domain);
+    return -1;
+  }
+  hb->ld.ed.domain_range[domain] = range / 1000000.0;
+  return 0;
+}
+
+void hb_set_max_power(heartbeat_t* hb, double max_power) {
+  hb->ld.ed.max_power = max_power;
+}
+
+void hb_set_power_cap(heartbeat_t* hb, double cap) {
+  hb->ld.ct.power_cap = cap;
+}
+
+void hb_set_controller(heartbeat_t* hb,
+                       double knob_min,
+                       double knob_max,
+                       double knob,
+                       double pole) {
+  hb->ld.ct.knob_min = knob_min;
+  hb->ld.ct.knob_max = knob_max;
+  hb->ld.ct.pole = pole;
+  hb->ld.ct.window_count = 0;
+  hb->ld.ct.speed = 0;
+  hb->ld.ct.speed_var = 0;
+  hb_set_knob(hb, knob);
+  hb->ld.ct.enabled = 1;
+}
+
+void hb_set_knob(heartbeat_t* hb, double knob) {
+  hb->ld.ct.knob = knob < hb->ld.ct.knob_min ? hb->ld.ct.knob_min :
+                   (knob > hb->ld.ct.knob_max ? hb->ld.ct.knob_max : knob);
+}
+
+/**
+ * Update the recommended knob at the end of a window.
+ */
+static inline void hb_control(heartbeat_t* hb,
+                              const _heartbeat_record_t* record) {
+  _heartbeat_control_data* ct = &hb->ld.ct;
+  double rate = record->window_perf;
+  double knob = ct->knob;
+  double target;
+  if (knob <= 0 || rate <= 0) {
+    return;
+  }
+
+  // estimate the rate per knob unit
+  double measured = rate / knob;
+  if (ct->speed <= 0) {
+    ct->speed = measured;
+    ct->speed_var = 1.0;
+  } else {
+    double q = HEARTBEAT_CONTROL_Q * ct->speed;
+    double r = HEARTBEAT_CONTROL_R * ct->speed;
+    double var = ct->speed_var + q * q;
+    double gain = var / (var + r * r);
+    ct->speed += gain * (measured - ct->speed);
+    ct->speed_var = (1 - gain) * var;
+  }
+
+  // steer toward the target rate if outside the goal
+  if (rate < ct->min_rate || rate > ct->max_rate) {
+    if (isinf(ct->max_rate)) {
+      target = ct->min_rate;
+    } else if (isinf(ct->min_rate)) {
+      target = ct->max_rate;
+    } else {
+      target = (ct->min_rate + ct->max_rate) / 2;
+    }
+    knob += (1 - ct->pole) * (target - rate) / ct->speed;
+  }
+
+  // power is assumed to scale with the knob too, so never recommend more
+  // than the cap allows, not just back off after exceeding it
+  if (ct->power_cap > 0 && record->window_pwr > 0) {
+    double capped = ct->knob * ct->power_cap / record->window_pwr;
+    knob = capped < knob ? capped : knob;
+  }
+  hb_set_knob(hb, knob);
+}
+
+int hb_set_phase_detection(heartbeat_t* hb,
+                           double threshold,
+                           double drift,
+                           uint64_t min_beats) {
+  if (threshold > 0 && min_beats < 2) {
+    fprintf(stderr, "Heartbeat phase detection needs min_beats >= 2\n");
+    return -1;
+  }
+  init_phase_data(&hb->ld.ph);
+  hb->ld.ph.threshold = threshold;
+  hb->ld.ph.drift = drift;
+  hb->ld.ph.min_beats = min_beats;
+  hb->ld.ph.enabled = threshold > 0;
+  return 0;
+}
+
+/**
+ * Run one CUSUM step. Returns 1 and sets start to the first beat of the
+ * shift if one is detected.
+ */
+static inline int hb_cusum(_heartbeat_cusum* c,
+                           const _heartbeat_phase_data* ph,
+                           double x,
+                           uint64_t id,
+                           uint64_t* start) {
+  double d;
+  double sd;
+  double z;
+  if (c->n < ph->min_beats) {
+    // still learning this phase's baseline
+    c->n++;
+    d = x - c->mean;
+    c->mean += d / c->n;
+    c->m2 += d * (x - c->mean);
+    return 0;
+  }
+  sd = sqrt(c->m2 / (c->n - 1));
+  if (sd < fabs(c->mean) * HEARTBEAT_PHASE_MIN_DEVIATION) {
+    sd = fabs(c->mean) * HEARTBEAT_PHASE_MIN_DEVIATION;
+  }
+  if (sd == 0) {
+    return 0;
+  }
+  // clip outliers so a single late beat can't raise a change on its own
+  z = fmax(-ph->threshold / 2, fmin(ph->threshold / 2, (x - c->mean) / sd));
+  if (c->pos == 0) {
+    c->pos_id = id;
+  }
+  if (c->neg == 0) {
+    c->neg_id = id;
+  }
+  c->pos = fmax(0, c->pos + z - ph->drift);
+  c->neg = fmax(0, c->neg - z - ph->drift);
+  if (c->pos > ph->threshold) {
+    *start = c->pos_id;
+    return 1;
+  }
+  if (c->neg > ph->threshold) {
+    *start = c->neg_id;
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Check the record for a phase change on rate or power. On a change, the
+ * boundary is recorded, the baselines are relearned and so is the
+ * controller's model.
+ */
+static inline int hb_detect_phase(heartbeat_t* hb,
+                                  const _heartbeat_record_t* record) {
+  _heartbeat_phase_data* ph = &hb->ld.ph;
+  uint64_t start = record->id;
+  uint64_t pwr_start = record->id;
+  int changed = hb_cusum(&ph->perf, ph, record->instant_perf, record->id,
+                         &start);
+  if (hb->ld.ef != NULL &&
+      hb_cusum(&ph->pwr, ph, record->instant_pwr, record->id, &pwr_start)) {
+    start = changed && start < pwr_start ? start : pwr_start;
+    changed = 1;
+  }
+  if (!changed) {
+    return 0;
+  }
+  ph->boundaries[ph->count % HEARTBEAT_PHASES_MAX] = start;
+  ph->count++;
+  init_cusum(&ph->perf);
+  init_cusum(&ph->pwr);
+  if (hb->ld.ct.enabled) {
+    hb->ld.ct.speed = 0;
+    hb->ld.ct.window_count = 0;
+  }
+  return 1;
+}
+
+static inline void set_window_values(heartbeat_t* hb,
+                                     int64_t latency_change,
+                                     int64_t active_change,
+                                     uint64_t work,
+                                     double accuracy,
+                                     double energy_change,
+                                     int64_t cpu_change) {
+  // the slot holds the values we're going to drop from the window
+  // if we haven't yet reached window_size heartbeats, they are 0
+  _heartbeat_window_entry* w = &hb->ld.window[hb->ld.window_index];
+  hb->ld.td.window_time += latency_change - w->latency;
+  hb->ld.sn.window_active += active_change - w->active;
+  hb->ld.wd.window_work += work - w->work;
+  hb->ld.cd.window_cpu_time += cpu_change - w->cpu_time;
+  hb->ld.ad.window_accuracy += accuracy - w->accuracy;
+  hb->ld.ed.window_energy += energy_change - w->energy;
+  w->latency = latency_change;
+  w->active = active_change;
+  w->work = work;
+  w->cpu_time = cpu_change;
+  w->accuracy = accuracy;
+  w->energy = energy_change;
+}
+
+/**
+ * Correct an energy delta for counter wraparound and reject deltas from
+ * counter resets or implying more than the max power. The counter may have
+ * accumulated a step for longer than one heartbeat, so power is judged over
+ * the time since the heartbeat before it last changed (last_change), which
+ * is updated here. The first change isn't judged, as the counter may have
+ * been accumulating it since before the first heartbeat.
+ */
+static inline double correct_energy_change(heartbeat_t* hb,
+                                           double change,
+                                           double range,
+                                           double window_energy,
+                                           int64_t time,
+                                           int64_t latency_change,
+                                           int64_t* last_change) {
+  // -1 until the first change
+  int64_t since = *last_change;
+  if (change == 0) {
+    return 0;
+  }
+  *last_change = time - latency_change;
+  if (change < 0 && change + range >= 0) {
+    change += range;
+    hb->ld.cr.energy_wraps++;
+  } else if (change < 0) {
+    // a reset, or wrapped with an unknown range
+    hb->ld.cr.energy_outliers++;
+    return 0;
+  }
+  // a latency of 0 (e.g. beats in the same tick) can't be judged
+  if (hb->ld.ed.max_power > 0 && latency_change > 0 && since >= 0 &&
+      change > hb->ld.ed.max_power * (time - since) / 1000000000.0) {
+    hb->ld.cr.energy_outliers++;
+    // assume the window's power held over this heartbeat
+    return hb->ld.td.window_time > 0 ?
+           window_energy * latency_change / hb->ld.td.window_time : 0;
+  }
+  return change;
+}
+
+static inline void process_energy_domains(heartbeat_t* hb,
+                                          uint64_t index,
+                                          const double* domain_energy,
+                                          int first,
+                                          int64_t time,
+                                          int64_t latency_change) {
+  const double one_billion = 1000000000.0;
+  double total_seconds = ((double) hb->ld.td.total_time) / one_billion;
+  double window_seconds = ((double) hb->ld.td.window_time) / one_billion;
+  double change;
+  _heartbeat_window_entry* w = &hb->ld.window[hb->ld.window_index];
+  unsigned int d;
+  for (d = 0; d < hb->ld.domain_count; d++) {
+    change = first ? 0 :
+             correct_energy_change(hb,
+                                   domain_energy[d] - hb->ld.ed.domain_last_energy[d],
+                                   hb->ld.ed.domain_range[d],
+                                   hb->ld.ed.domain_window_energy[d],
+                                   time, latency_change,
+                                   &hb->ld.ed.domain_last_change[d]);
+    hb->ld.ed.domain_last_energy[d] = domain_energy[d];
+    hb->ld.ed.domain_total_energy[d] += change;
+    hb->ld.ed.domain_window_energy[d] += change - w->domain_energy[d];
+    w->domain_energy[d] = change;
+    hb->ld.log[index].domain_energy[d] = change;
+    hb->ld.log[index].domain_global_pwr[d] = total_seconds == 0 ? 0 :
+      hb->ld.ed.domain_total_energy[d] / total_seconds;
+    hb->ld.log[index].domain_window_pwr[d] = window_seconds == 0 ? 0 :
+      hb->ld.ed.domain_window_energy[d] / window_seconds;
+  }
+}
+
+static inline void set_efficiency(double* epw,
+                                  double* edp,
+                                  double energy,
+                                  double seconds,
+                                  uint64_t work) {
+  if (work == 0) {
+    *epw = 0;
+    *edp = 0;
+  } else {
+    *epw = energy / work;
+    *edp = *epw * (seconds / work);
+  }
+}
+
+/*
+ * Running totals that the derived values in a record are computed from.
+ */
+typedef struct {
+  int64_t total_time;
+  int64_t window_time;
+  int64_t total_active;
+  int64_t window_active;
+  uint64_t total_work;
+  uint64_t window_work;
+  double total_accuracy;
+  double window_accuracy;
+  double total_energy;
+  double window_energy;
+  int64_t total_cpu_time;
+  int64_t window_cpu_time;
+} hb_totals;
+
+/**
+ * Fill in a record's rates from its raw values and the running totals.
+ */
+static inline void set_rates(_heartbeat_record_t* r, const hb_totals* t) {
+  const double one_billion = 1000000000.0;
+  double total_seconds = ((double) t->total_time) / one_billion;
+  double window_seconds = ((double) t->window_time) / one_billion;
+  double instant_seconds = ((double) r->latency) / one_billion;
+  // each rate is 0 while its own time is; with a coarse clock (see
+  // hb_tick_clock_start()) many heartbeats share a timestamp, but the
+  // totals still advance
+  if (t->total_time == 0) {
+    r->global_perf = 0;
+    r->global_acc = 0;
+    r->global_pwr = 0;
+    r->global_epw = 0;
+    r->global_edp = 0;
+    r->global_cpu = 0;
+  } else {
+    r->global_perf = ((double) t->total_work) / total_seconds;
+    r->global_acc = t->total_accuracy / total_seconds;
+    r->global_pwr = t->total_energy / total_seconds;
+    // energy and delay per unit of work; EDP is their product
+    set_efficiency(&r->global_epw, &r->global_edp,
+                   t->total_energy, total_seconds, t->total_work);
+    // CPU time and elapsed time are both in ns
+    r->global_cpu = ((double) t->total_cpu_time) / t->total_time;
+  }
+  if (t->window_time == 0) {
+    r->window_perf = 0;
+    r->window_acc = 0;
+    r->window_pwr = 0;
+    r->window_epw = 0;
+    r->window_edp = 0;
+    r->window_cpu = 0;
+  } else {
+    r->window_perf = ((double) t->window_work) / window_seconds;
+    r->window_acc = t->window_accuracy / window_seconds;
+    r->window_pwr = t->window_energy / window_seconds;
+    set_efficiency(&r->window_epw, &r->window_edp,
+                   t->window_energy, window_seconds, t->window_work);
+    r->window_cpu = ((double) t->window_cpu_time) / t->window_time;
+  }
+  if (r->latency == 0) {
+    r->instant_perf = 0;
+    r->instant_acc = 0;
+    r->instant_pwr = 0;
+    r->instant_epw = 0;
+    r->instant_edp = 0;
+    r->instant_cpu = 0;
+  } else {
+    r->instant_perf = ((double) r->work) / instant_seconds;
+    r->instant_acc = r->accuracy / instant_seconds;
+    r->instant_pwr = r->energy / instant_seconds;
+    set_efficiency(&r->instant_epw, &r->instant_edp,
+                   r->energy, instant_seconds, r->work);
+    r->instant_cpu = ((double) r->cpu_time) / r->latency;
+  }
+  // rates over span time only, which may be 0 even when latency isn't
+  r->global_active_perf = t->total_active == 0 ? 0 :
+                          t->total_work / (t->total_active / one_billion);
+  r->window_active_perf = t->window_active == 0 ? 0 :
+                          t->window_work / (t->window_active / one_billion);
+  r->instant_active_perf = r->active == 0 ? 0 :
+                           r->work / (r->active / one_billion);
+}
+
+/*
+ * Compressed history: records are encoded into blocks of
+ * HEARTBEAT_HISTORY_BLOCK_RECORDS as a bit stream. Integers are stored as
+ * the (zigzag) difference from the previous value - the delta-of-delta for
+ * IDs, tags and timestamps, which are normally evenly spaced - and doubles
+ * as the XOR with the previous value with leading and trailing zeros
+ * omitted (as in Facebook's Gorilla). Each block starts from zeroed
+ * previous values and saves the running totals before its first record,
+ * so decoding can start at any block.
+ */
+typedef struct {
+  uint64_t prev;
+  unsigned int lead;
+  unsigned int trail;
+} hb_xor_state;
+
+typedef struct {
+  uint64_t shared_id;
+  uint64_t shared_delta;
+  uint64_t user_tag;
+  uint64_t tag_delta;
+  uint64_t timestamp;
+  uint64_t time_delta;
+  uint64_t work;
+  uint64_t cpu_time;
+  uint64_t vcsw;
+  uint64_t ivcsw;
+  uint64_t critical;
+  hb_xor_state accuracy;
+  hb_xor_state energy;
+  hb_xor_state domain_energy[HEARTBEAT_ENERGY_DOMAINS_MAX];
+} hb_codec;
+
+typedef struct {
+  uint64_t first_id;
+  uint64_t count;
+  uint64_t bits;
+  uint8_t* data;
+  hb_totals start;
+  double domain_total_energy[HEARTBEAT_ENERGY_DOMAINS_MAX];
+  double domain_window_energy[HEARTBEAT_ENERGY_DOMAINS_MAX];
+} hb_block;
+
+struct _heartbeat_history {
+  pthread_mutex_t mutex;
+  unsigned int domain_count;
+  uint64_t max_blocks;
+  // oldest block and number of blocks, the newest is being written
+  uint64_t head;
+  uint64_t count;
+  // bytes in sealed blocks
+  uint64_t bytes;
+  // set when disabled or out of memory, no more records are added
+  char full;
+  hb_codec enc;
+  hb_block* blocks;
+};
+
+// raw values of a decoded record needed to slide the window
+typedef struct {
+  int64_t latency;
+  int64_t active;
+  uint64_t work;
+  double accuracy;
+  double energy;
+  int64_t cpu_time;
+  double domain_energy[HEARTBEAT_ENERGY_DOMAINS_MAX];
+} hb_window_values;
+
+static inline void hb_put_bits(hb_block* b, uint64_t v, unsigned int n) {
+  unsigned int room;
+  unsigned int take;
+  while (n > 0) {
+    room = 8 - (b->bits & 7);
+    take = n < room ? n : room;
+    b->data[b->bits >> 3] |= (uint8_t) (((v >> (n - take)) & ((1u << take) - 1)) << (room - take));
+    b->bits += take;
+    n -= take;
+  }
+}
+
+static inline uint64_t hb_get_bits(const hb_block* b, uint64_t* pos, unsigned int n) {
+  uint64_t v = 0;
+  unsigned int room;
+  unsigned int take;
+  while (n > 0) {
+    room = 8 - (*pos & 7);
+    take = n < room ? n : room;
+    v = (v << take) |
+        ((b->data[*pos >> 3] >> (room - take)) & ((1u << take) - 1));
+    *pos += take;
+    n -= take;
+  }
+  return v;
+}
+
+static inline uint64_t hb_zigzag(uint64_t v) {
+  return (v << 1) ^ (uint64_t) ((int64_t) v >> 63);
+}
+
+static inline uint64_t hb_unzigzag(uint64_t v) {
+  return (v >> 1) ^ (0 - (v & 1));
+}
+
+// '0' for 0, else '1', 6 bits of length - 1 and the value
+static inline void hb_put_int(hb_block* b, uint64_t v) {
+  unsigned int len;
+  v = hb_zigzag(v);
+  if (v == 0) {
+    hb_put_bits(b, 0, 1);
+  } else {
+    len = 64 - __builtin_clzll(v);
+    hb_put_bits(b, 0x40 | (len - 1), 7);
+    hb_put_bits(b, v, len);
+  }
+}
+
+static inline uint64_t hb_get_int(const hb_block* b, uint64_t* pos) {
+  if (hb_get_bits(b, pos, 1) == 0) {
+    return 0;
+  }
+  return hb_unzigzag(hb_get_bits(b, pos, (unsigned int) hb_get_bits(b, pos, 6) + 1));
+}
+
+static inline void hb_put_double(hb_block* b, hb_xor_state* s, double d) {
+  uint64_t v;
+  uint64_t x;
+  unsigned int lead;
+  unsigned int trail;
+  memcpy(&v, &d, sizeof(v));
+  x = v ^ s->prev;
+  s->prev = v;
+  if (x == 0) {
+    hb_put_bits(b, 0, 1);
+    return;
+  }
+  lead = __builtin_clzll(x);
+  lead = lead > 31 ? 31 : lead;
+  trail = __builtin_ctzll(x);
+  if (s->lead + s->trail > 0 && lead >= s->lead && trail >= s->trail) {
+    // fits in the previous meaningful bits
+    hb_put_bits(b, 2, 2);
+    hb_put_bits(b, x >> s->trail, 64 - s->lead - s->trail);
+  } else {
+    hb_put_bits(b, 3, 2);
+    hb_put_bits(b, lead, 5);
+    hb_put_bits(b, 63 - lead - trail, 6);
+    hb_put_bits(b, x >> trail, 64 - lead - trail);
+    s->lead = lead;
+    s->trail = trail;
+  }
+}
+
+static inline double hb_get_double(const hb_block* b, uint64_t* pos, hb_xor_state* s) {
+  uint64_t x = 0;
+  double d;
+  if (hb_get_bits(b, pos, 1) != 0) {
+    if (hb_get_bits(b, pos, 1) == 0) {
+      x = hb_get_bits(b, pos, 64 - s->lead - s->trail) << s->trail;
+    } else {
+      s->lead = (unsigned int) hb_get_bits(b, pos, 5);
+      s->trail = 63 - s->lead - (unsigned int) hb_get_bits(b, pos, 6);
+      x = hb_get_bits(b, pos, 64 - s->lead - s->trail) << s->trail;
+    }
+  }
+  s->prev ^= x;
+  memcpy(&d, &s->prev, sizeof(d));
+  return d;
+}
+
+// worst case encoded size of a record
+#define HEARTBEAT_HISTORY_RECORD_BITS \
+  (10 * 71 + (2 + HEARTBEAT_ENERGY_DOMAINS_MAX) * 77)
+#define HEARTBEAT_HISTORY_BLOCK_BYTES \
+  ((HEARTBEAT_HISTORY_BLOCK_RECORDS * HEARTBEAT_HISTORY_RECORD_BITS + 7) / 8)
+
+/**
+ * Start a new block after the latest record, dropping the oldest if full.
+ */
+static int hb_history_open_block(heartbeat_t* hb, struct _heartbeat_history* hs) {
+  hb_block* b;
+  if (hs->count == hs->max_blocks) {
+    b = &hs->blocks[hs->head];
+    hs->bytes -= (b->bits + 7) / 8;
+    free(b->data);
+    hs->head = (hs->head + 1) % hs->max_blocks;
+    hs->count--;
+  }
+  b = &hs->blocks[(hs->head + hs->count) % hs->max_blocks];
+  b->data = calloc(1, HEARTBEAT_HISTORY_BLOCK_BYTES);
+  if (b->data == NULL) {
+    return -1;
+  }
+  b->first_id = hb->ld.counter;
+  b->count = 0;
+  b->bits = 0;
+  b->start.total_time = hb->ld.td.total_time;
+  b->start.window_time = hb->ld.td.window_time;
+  b->start.total_active = hb->ld.sn.total_active;
+  b->start.window_active = hb->ld.sn.window_active;
+  b->start.total_work = hb->ld.wd.total_work;
+  b->start.window_work = hb->ld.wd.window_work;
+  b->start.total_accuracy = hb->ld.ad.total_accuracy;
+  b->start.window_accuracy = hb->ld.ad.window_accuracy;
+  b->start.total_energy = hb->ld.ed.total_energy;
+  b->start.window_energy = hb->ld.ed.window_energy;
+  b->start.total_cpu_time = hb->ld.cd.total_cpu_time;
+  b->start.window_cpu_time = hb->ld.cd.window_cpu_time;
+  memcpy(b->domain_total_energy, hb->ld.ed.domain_total_energy,
+         sizeof(b->domain_total_energy));
+  memcpy(b->domain_window_energy, hb->ld.ed.domain_window_energy,
+         sizeof(b->domain_window_energy));
+  memset(&hs->enc, 0, sizeof(hs->enc));
+  hs->count++;
+  return 0;
+}
+
+static void hb_clear_history(struct _heartbeat_history* hs) {
+  uint64_t i;
+  for (i = 0; i < hs->count; i++) {
+    free(hs->blocks[(hs->head + i) % hs->max_blocks].data);
+  }
+  free(hs->blocks);
+  hs->blocks = NULL;
+  hs->max_blocks = 0;
+  hs->head = 0;
+  hs->count = 0;
+  hs->bytes = 0;
+}
+
+static void hb_free_history(struct _heartbeat_history* hs) {
+  if (hs != NULL) {
+    hb_clear_history(hs);
+    pthread_mutex_destroy(&hs->mutex);
+    free(hs);
+  }
+}
+
+/*
+ * Readers may load hb->ld.hs at any time without synchronizing with the
+ * producer, so once allocated it is only freed by heartbeat_finish().
+ * Resizing or disabling replaces its blocks under its mutex instead.
+ */
+int hb_set_compressed_history(heartbeat_t* hb, uint64_t records) {
+  struct _heartbeat_history* hs = hb->ld.hs;
+  struct _heartbeat_history next;
+  if (hs == NULL) {
+    if (records == 0) {
+      return 0;
+    }
+    hs = calloc(1, sizeof(struct _heartbeat_history));
+    if (hs == NULL) {
+      perror("Failed to allocate heartbeat compressed history");
+      return -1;
+    }
+    pthread_mutex_init(&hs->mutex, NULL);
+    hs->full = 1;
+    __atomic_store_n(&hb->ld.hs, hs, __ATOMIC_RELEASE);
+  }
+  // build the new blocks first so a failure leaves the current history
+  memset(&next, 0, sizeof(next));
+  next.domain_count = hb->ld.domain_count;
+  next.full = records == 0;
+  if (records > 0) {
+    // one extra for the block being written
+    next.max_blocks = (records + HEARTBEAT_HISTORY_BLOCK_RECORDS - 1) /
+                      HEARTBEAT_HISTORY_BLOCK_RECORDS + 1;
+    next.blocks = calloc(next.max_blocks, sizeof(hb_block));
+    if (next.blocks == NULL || hb_history_open_block(hb, &next)) {
+      perror("Failed to allocate heartbeat compressed history");
+      free(next.blocks);
+      return -1;
+    }
+  }
+  pthread_mutex_lock(&hs->mutex);
+  hb_clear_history(hs);
+  hs->domain_count = next.domain_count;
+  hs->max_blocks = next.max_blocks;
+  hs->head = next.head;
+  hs->count = next.count;
+  hs->bytes = next.bytes;
+  hs->full = next.full;
+  hs->enc = next.enc;
+  hs->blocks = next.blocks;
+  pthread_mutex_unlock(&hs->mutex);
+  return 0;
+}
+
+/**
+ * Append the latest record to the compressed history.
+ */
+static void hb_history_append(heartbeat_t* hb, const _heartbeat_record_t* r) {
+  struct _heartbeat_history* hs = hb->ld.hs;
+  hb_codec* enc = &hs->enc;
+  uint64_t delta;
+  unsigned int d;
+  pthread_mutex_lock(&hs->mutex);
+  if (hs->full) {
+    pthread_mutex_unlock(&hs->mutex);
+    return;
+  }
+  hb_block* b = &hs->blocks[(hs->head + hs->count - 1) % hs->max_blocks];
+
+  delta = r->shared_id - enc->shared_id;
+  hb_put_int(b, delta - enc->shared_delta);
+  enc->shared_id = r->shared_id;
+  enc->shared_delta = delta;
+  delta = r->user_tag - enc->user_tag;
+  hb_put_int(b, delta - enc->tag_delta);
+  enc->user_tag = r->user_tag;
+  enc->tag_delta = delta;
+  delta = r->timestamp - enc->timestamp;
+  hb_put_int(b, delta - enc->time_delta);
+  enc->timestamp = r->timestamp;
+  enc->time_delta = delta;
+  // latency is normally the time since the previous record
+  hb_put_int(b, (uint64_t) r->latency - delta);
+  // idle time, normally 0 unless spans are used
+  hb_put_int(b, (uint64_t) (r->latency - r->active));
+  hb_put_int(b, r->work - enc->work);
+  enc->work = r->work;
+  hb_put_int(b, (uint64_t) r->cpu_time - enc->cpu_time);
+  enc->cpu_time = (uint64_t) r->cpu_time;
+  hb_put_int(b, r->vcsw - enc->vcsw);
+  enc->vcsw = r->vcsw;
+  hb_put_int(b, r->ivcsw - enc->ivcsw);
+  enc->ivcsw = r->ivcsw;
+  hb_put_int(b, (uint64_t) r->critical - enc->critical);
+  enc->critical = (uint64_t) r->critical;
+  hb_put_double(b, &enc->accuracy, r->accuracy);
+  hb_put_double(b, &enc->energy, r->energy);
+  for (d = 0; d < hs->domain_count; d++) {
+    hb_put_double(b, &enc->domain_energy[d], r->domain_energy[d]);
+  }
+
+  if (++b->count == HEARTBEAT_HISTORY_BLOCK_RECORDS) {
+    // seal the block, keeping only what was used
+    uint8_t* data = realloc(b->data, (b->bits + 7) / 8);
+    if (data != NULL) {
+      b->data = data;
+    }
+    hs->bytes += (b->bits + 7) / 8;
+    if (hb_history_open_block(hb, hs)) {
+      perror("Failed to allocate heartbeat compressed history block");
+      // keep the history so far but stop adding to it
+      hs->full = 1;
+    }
+  }
+  pthread_mutex_unlock(&hs->mutex);
+}
+
+uint64_t hb_get_compressed_history_size(const heartbeat_t* hb) {
+  struct _heartbeat_history* hs = __atomic_load_n(&hb->ld.hs, __ATOMIC_ACQUIRE);
+  uint64_t size = 0;
+  if (hs == NULL) {
+    return 0;
+  }
+  pthread_mutex_lock(&hs->mutex);
+  if (hs->count > 0) {
+    size = hs->bytes + hs->max_blocks * sizeof(hb_block);
+    if (!hs->full) {
+      // the block being written isn't counted in bytes yet
+      size += (hs->blocks[(hs->head + hs->count - 1) % hs->max_blocks].bits + 7) / 8;
+    }
+  }
+  pthread_mutex_unlock(&hs->mutex);
+  return size;
+}
+
+uint64_t hb_get_compressed_history(const heartbeat_t* hb,
+                                   heartbeat_record_t* record,
+                                   uint64_t n) {
+  struct _heartbeat_history* hs = __atomic_load_n(&hb->ld.hs, __ATOMIC_ACQUIRE);
+  const uint64_t window = hb->window_size;
+  hb_window_values* values;
+  hb_window_values* v;
+  const hb_window_values* old;
+  const hb_window_values zero = { 0 };
+  const hb_block* b;
+  _heartbeat_record_t r;
+  hb_totals t = { 0 };
+  hb_codec dec;
+  double domain_total[HEARTBEAT_ENERGY_DOMAINS_MAX] = { 0 };
+  double domain_window[HEARTBEAT_ENERGY_DOMAINS_MAX] = { 0 };
+  double total_seconds;
+  double window_seconds;
+  uint64_t oldest;
+  uint64_t end;
+  uint64_t start;
+  uint64_t first;
+  uint64_t replay;
+  uint64_t delta;
+  uint64_t pos;
+  uint64_t ret = 0;
+  uint64_t i;
+  uint64_t k;
+  unsigned int d;
+
+  if (hs == NULL || n == 0) {
+    return 0;
+  }
+  values = calloc(window, sizeof(hb_window_values));
+  if (values == NULL) {
+    perror("Failed to allocate heartbeat history window");
+    return 0;
+  }
+  pthread_mutex_lock(&hs->mutex);
+  if (hs->count == 0) {
+    // disabled
+    pthread_mutex_unlock(&hs->mutex);
+    free(values);
+    return 0;
+  }
+  oldest = hs->blocks[hs->head].first_id;
+  b = &hs->blocks[(hs->head + hs->count - 1) % hs->max_blocks];
+  end = b->first_id + b->count;
+
+  // totals are replayed from the start of a block, which needs the window
+  // before it to be in the history too (or before the first heartbeat)
+  first = oldest;
+  if (oldest > 0) {
+    first += (window + HEARTBEAT_HISTORY_BLOCK_RECORDS - 1) /
+             HEARTBEAT_HISTORY_BLOCK_RECORDS * HEARTBEAT_HISTORY_BLOCK_RECORDS;
+  }
+  start = end > n ? end - n : 0;
+  start = start > first ? start : first;
+  if (start >= end) {
+    pthread_mutex_unlock(&hs->mutex);
+    free(values);
+    return 0;
+  }
+  // the block to replay totals from, and the first one with a record in its window
+  replay = oldest + (start - oldest) / HEARTBEAT_HISTORY_BLOCK_RECORDS *
+           HEARTBEAT_HISTORY_BLOCK_RECORDS;
+  i = replay >= oldest + window ? replay - window : oldest;
+  i = oldest + (i - oldest) / HEARTBEAT_HISTORY_BLOCK_RECORDS * HEARTBEAT_HISTORY_BLOCK_RECORDS;
+
+  for (; i < end; i += HEARTBEAT_HISTORY_BLOCK_RECORDS) {
+    b = &hs->blocks[(hs->head + (i - oldest) / HEARTBEAT_HISTORY_BLOCK_RECORDS) %
+                    hs->max_blocks];
+    if (b->first_id == replay) {
+      t = b->start;
+      memcpy(domain_total, b->domain_total_energy, sizeof(domain_total));
+      memcpy(domain_window, b->domain_window_energy, sizeof(domain_window));
+    }
+    memset(&dec, 0, sizeof(dec));
+    memset(&r, 0, sizeof(r));
+    pos = 0;
+    for (k = 0; k < b->count; k++) {
+      r.id = b->first_id + k;
+      delta = dec.shared_delta + hb_get_int(b, &pos);
+      r.shared_id = dec.shared_id += delta;
+      dec.shared_delta = delta;
+      delta = dec.tag_delta + hb_get_int(b, &pos);
+      r.user_tag = dec.user_tag += delta;
+      dec.tag_delta = delta;
+      delta = dec.time_delta + hb_get_int(b, &pos);
+      r.timestamp = dec.timestamp += delta;
+      dec.time_delta = delta;
+      r.latency = (int64_t) (delta + hb_get_int(b, &pos));
+      r.active = r.latency - (int64_t) hb_get_int(b, &pos);
+      r.work = dec.work += hb_get_int(b, &pos);
+      r.cpu_time = (int64_t) (dec.cpu_time += hb_get_int(b, &pos));
+      r.vcsw = dec.vcsw += hb_get_int(b, &pos);
+      r.ivcsw = dec.ivcsw += hb_get_int(b, &pos);
+      r.critical = (int64_t) (dec.critical += hb_get_int(b, &pos));
+      r.accuracy = hb_get_double(b, &pos, &dec.accuracy);
+      r.energy = hb_get_double(b, &pos, &dec.energy);
+      for (d = 0; d < hs->domain_count; d++) {
+        r.domain_energy[d] = hb_get_double(b, &pos, &dec.domain_energy[d]);
+      }
+
+      if (r.id >= replay) {
+        // same operations as process_heartbeat() and set_window_values()
+        old = r.id >= window ? &values[(r.id - window) % window] : &zero;
+        t.total_time += r.latency;
+        t.total_work += r.work;
+        t.total_accuracy += r.accuracy;
+        t.total_energy += r.energy;
+        t.total_cpu_time += r.cpu_time;
+        t.window_time += r.latency - old->latency;
+        t.total_active += r.active;
+        t.window_active += r.active - old->active;
+        t.window_work += r.work - old->work;
+        t.window_cpu_time += r.cpu_time - old->cpu_time;
+        t.window_accuracy += r.accuracy - old->accuracy;
+        t.window_energy += r.energy - old->energy;
+        total_seconds = ((double) t.total_time) / 1000000000.0;
+        window_seconds = ((double) t.window_time) / 1000000000.0;
+        for (d = 0; d < hs->domain_count; d++) {
+          domain_total[d] += r.domain_energy[d];
+          domain_window[d] += r.domain_energy[d] - old->domain_energy[d];
+          r.domain_global_pwr[d] = total_seconds == 0 ? 0 :
+                                   domain_total[d] / total_seconds;
+          r.domain_window_pwr[d] = window_seconds == 0 ? 0 :
+                                   domain_window[d] / window_seconds;
+        }
+        if (r.id >= start) {
+          set_rates(&r, &t);
+          record[ret++] = r;
+        }
+      }
+
+      v = &values[r.id % window];
+      v->latency = r.latency;
+      v->active = r.active;
+      v->work = r.work;
+      v->accuracy = r.accuracy;
+      v->energy = r.energy;
+      v->cpu_time = r.cpu_time;
+      memcpy(v->domain_energy, r.domain_energy, sizeof(v->domain_energy));
+    }
+  }
+  pthread_mutex_unlock(&hs->mutex);
+  free(values);
+  return ret;
+}
+
+int hb_add_rollup(heartbeat_t* hb, int64_t interval, uint64_t buckets) {
+  _heartbeat_rollup_data* ru = &hb->ld.ru;
+  _heartbeat_rollup_tier* tier;
+  if (interval <= 0 || buckets == 0) {
+    fprintf(stderr, "Heartbeat rollup interval and buckets must be > 0\n");
+    return -1;
+  }
+  if (ru->count >= HEARTBEAT_ROLLUP_TIERS_MAX) {
+    fprintf(stderr, "Too many heartbeat rollup tiers, max is %d\n",
+            HEARTBEAT_ROLLUP_TIERS_MAX);
+    return -1;
+  }
+  tier = &ru->tiers[ru->count];
+  tier->buckets = calloc(buckets, sizeof(_heartbeat_rollup_t));
+  if (tier->buckets == NULL) {
+    perror("Failed to allocate heartbeat rollup buckets");
+    return -1;
+  }
+  tier->interval = interval;
+  tier->size = buckets;
+  return (int) ru->count++;
+}
+
+/**
+ * Fold a record into the bucket covering its timestamp in every rollup tier,
+ * reusing the slot of the oldest bucket once a new interval starts.
+ */
+static inline void hb_rollup_append(heartbeat_t* hb,
+                                    const _heartbeat_record_t* r) {
+  _heartbeat_rollup_data* ru = &hb->ld.ru;
+  _heartbeat_rollup_tier* tier;
+  _heartbeat_rollup_t* b;
+  int64_t time = (int64_t) r->timestamp;
+  int64_t start;
+  unsigned int i;
+  for (i = 0; i < ru->count; i++) {
+    tier = &ru->tiers[i];
+    start = time - time % tier->interval;
+    b = &tier->buckets[(uint64_t) (time / tier->interval) % tier->size];
+    if (b->count == 0 || b->start != start) {
+      b->start = start;
+      b->count = 0;
+      b->work = 0;
+      b->time = 0;
+      b->accuracy = 0;
+      b->energy = 0;
+      b->min_latency = r->latency;
+      b->max_latency = r->latency;
+    } else if (r->latency < b->min_latency) {
+      b->min_latency = r->latency;
+    } else if (r->latency > b->max_latency) {
+      b->max_latency = r->latency;
+    }
+    b->count++;
+    b->work += r->work;
+    b->time += r->latency;
+    b->accuracy += r->accuracy;
+    b->energy += r->energy;
+  }
+}
+
+/**
+ * Copy the non-empty buckets of a tier that start in [from, to), oldest
+ * first. The range is limited to the buckets that can still be held as of
+ * the last heartbeat.
+ */
+static uint64_t hb_copy_rollup(const heartbeat_t* hb,
+                               const _heartbeat_rollup_tier* tier,
+                               int64_t from,
+                               int64_t to,
+                               _heartbeat_rollup_t* buckets,
+                               uint64_t n) {
+  const int64_t interval = tier->interval;
+  const int64_t last = hb->ld.td.last_timestamp;
+  const _heartbeat_rollup_t* b;
+  int64_t oldest = last - last % interval -
+                   (int64_t) (tier->size - 1) * interval;
+  int64_t start;
+  uint64_t ret = 0;
+  if (from < oldest) {
+    from = oldest;
+  }
+  if (to > last + 1) {
+    to = last + 1;
+  }
+  start = from - from % interval;
+  if (start < from) {
+    start += interval;
+  }
+  for (; start < to && ret < n; start += interval) {
+    b = &tier->buckets[(uint64_t) (start / interval) % tier->size];
+    if (b->count > 0 && b->start == start) {
+      buckets[ret++] = *b;
+    }
+  }
+  return ret;
+}
+
+uint64_t hb_get_rollup(const heartbeat_t* hb,
+                       unsigned int tier,
+                       int64_t from,
+                       int64_t to,
+                       heartbeat_rollup_t* buckets,
+                       uint64_t n) {
+  uint64_t seq;
+  uint64_t ret;
+  if (tier >= hb->ld.ru.count) {
+    return 0;
+  }
+  // same sequence lock as the log buffer, see hb_get_history()
+  do {
+    while ((seq = __atomic_load_n(&hb->ld.seq, __ATOMIC_ACQUIRE)) & 1);
+    ret = hb_copy_rollup(hb, &hb->ld.ru.tiers[tier], from, to, buckets, n);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while (__atomic_load_n(&hb->ld.seq, __ATOMIC_RELAXED) != seq);
+  return ret;
+}
+
+int hb_get_rollup_summary(const heartbeat_t* hb,
+                          unsigned int tier,
+                          int64_t from,
+                          int64_t to,
+                          heartbeat_rollup_t* summary) {
+  heartbeat_rollup_t* buckets;
+  uint64_t n;
+  uint64_t i;
+  memset(summary, 0, sizeof(heartbeat_rollup_t));
+  if (tier >= hb->ld.ru.count) {
+    return -1;
+  }
+  buckets = malloc(hb->ld.ru.tiers[tier].size * sizeof(heartbeat_rollup_t));
+  if (buckets == NULL) {
+    perror("Failed to allocate heartbeat rollup buckets");
+    return -1;
+  }
+  n = hb_get_rollup(hb, tier, from, to, buckets, hb->ld.ru.tiers[tier].size);
+  for (i = 0; i < n; i++) {
+    if (i == 0) {
+      summary->start = buckets[i].start;
+      summary->min_latency = buckets[i].min_latency;
+      summary->max_latency = buckets[i].max_latency;
+    } else if (buckets[i].min_latency < summary->min_latency) {
+      summary->min_latency = buckets[i].min_latency;
+    }
+    if (buckets[i].max_latency > summary->max_latency) {
+      summary->max_latency = buckets[i].max_latency;
+    }
+    summary->count += buckets[i].count;
+    summary->work += buckets[i].work;
+    summary->time += buckets[i].time;
+    summary->accuracy += buckets[i].accuracy;
+    summary->energy += buckets[i].energy;
+  }
+  free(buckets);
+  return 0;
+}
+
+static void hb_free_rollups(_heartbeat_rollup_data* ru) {
+  unsigned int i;
+  for (i = 0; i < ru->count; i++) {
+    free(ru->tiers[i].buckets);
+  }
+  ru->count = 0;
+}
+
+void heartbeat_finish(heartbeat_t* hb) {
+  if (hb != NULL) {
+    hb_stop_events(hb);
+    if (hb->shm_name != NULL) {
+      if (hb->sd != NULL) {
+        hb_detach_shared(hb->sd, hb->shm_name, hb->shm_fd);
+      }
+      free(hb->shm_name);
+    } else if (hb->parent == NULL && hb->sd != NULL) {
+#ifdef HEARTBEAT_USE_PTHREADS_LOCK
+      pthread_mutex_destroy(&hb->sd->mutex);
+#endif
+      free(hb->sd);
+    }
+    // cleanup local data
+    if (hb->ld.lr.log_name != NULL) {
+      hb_flush_buffer(hb);
+      if (hb->ld.text_file != NULL) {
+        fclose(hb->ld.text_file);
+      }
+    }
+    hb_wait_compress(&hb->ld.lr);
+    free(hb->ld.lr.log_name);
+    free(hb->ld.text_buf);
+    hb_free_history(hb->ld.hs);
+    hb_free_rollups(&hb->ld.ru);
+    if (hb->ld.state_map != NULL) {
+      munmap(hb->ld.state_map, hb->ld.state_size);
+    }
+    hb_free_buffer(hb->ld.log, hb->ld.buffer_depth);
+    free(hb->ld.window);
+    free(hb);
+  }
+}
+
+static inline void process_heartbeat(heartbeat_t* hb,
+                                     uint64_t user_tag,
+                                     uint64_t work,
+                                     double accuracy,
+                                     int64_t time,
+                                     double energy,
+                                     const double* domain_energy,
+                                     int64_t cpu_time,
+                                     uint64_t vcsw,
+                                     uint64_t ivcsw,
+                                     int critical) {
+  int first = hb->ld.valid == 0;
+  int64_t latency_change;
+  int64_t active_change;
+  double energy_change;
+  int64_t cpu_change;
+  uint64_t vcsw_change;
+  uint64_t ivcsw_change;
+
+  // update shared data
+  uint64_t shared_id;
+  if (hb->sd->pshared) {
+    // other processes may not share our lock
+    shared_id = __atomic_fetch_add(&hb->sd->counter, 1, __ATOMIC_RELAXED);
+  } else {
+    shared_id = hb->sd->counter++;
+  }
+  if (hb->sd->valid == 0) {
+    hb->sd->valid = 1;
+  } else {
+    // the clock may step backward, never count negative time
+    if (time > hb->sd->td.last_timestamp) {
+      hb->sd->td.total_time += time - hb->sd->td.last_timestamp;
+    }
+  }
+  hb->sd->td.last_timestamp = time;
+
+  // update local data - readers retry while seq is odd
+  __atomic_store_n(&hb->ld.seq, hb->ld.seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  if (hb->ld.valid == 0) {
+    hb->ld.valid = 1;
+    latency_change = 0;
+    active_change = 0;
+    energy_change = 0;
+    cpu_change = 0;
+    vcsw_change = 0;
+    ivcsw_change = 0;
+    accuracy = 0;
+    work = 0;
+  } else {
+    latency_change = time - hb->ld.td.last_timestamp;
+    if (latency_change < 0) {
+      latency_change = 0;
+      hb->ld.cr.time_steps++;
+    }
+    // without spans, the whole interval is active
+    active_change = hb->ld.sn.spans > 0 ? hb->ld.sn.active : latency_change;
+    energy_change = correct_energy_change(hb, energy - hb->ld.ed.last_energy,
+                                          hb->ld.ed.range,
+                                          hb->ld.ed.window_energy,
+                                          time, latency_change,
+                                          &hb->ld.ed.last_change);
+    cpu_change = cpu_time - hb->ld.cd.last_cpu_time;
+    vcsw_change = vcsw - hb->ld.cd.last_vcsw;
+    ivcsw_change = ivcsw - hb->ld.cd.last_ivcsw;
+    hb->ld.td.total_time += latency_change;
+    hb->ld.sn.total_active += active_change;
+    hb->ld.wd.total_work += work;
+    hb->ld.ad.total_accuracy += accuracy;
+    hb->ld.ed.total_energy += energy_change;
+    hb->ld.cd.total_cpu_time += cpu_change;
+  }
+  hb->ld.sn.active = 0;
+  hb->ld.sn.spans = 0;
+  set_window_values(hb, latency_change, active_change, work, accuracy,
+                    energy_change, cpu_change);
+  hb->ld.td.last_timestamp = time;
+  hb->ld.ed.last_energy = energy;
+  hb->ld.cd.last_cpu_time = cpu_time;
+  hb->ld.cd.last_vcsw = vcsw;
+  hb->ld.cd.last_ivcsw = ivcsw;
+  hb->ld.counter++;
+  uint64_t index = hb->ld.buffer_index;
+
+  // now store in log
   hb->ld.log[index].id = hb->ld.counter - 1;
-  hb->ld.log[index].shared_id = hb->sd->counter - 1;
+  hb->ld.log[index].shared_id = shared_id;
   hb->ld.log[index].user_tag = user_tag;
   hb->ld.log[index].timestamp = time;
+  hb->ld.log[index].critical = critical;
   hb->ld.log[index].work = work;
   hb->ld.log[index].latency = latency_change;
+  hb->ld.log[index].active = active_change;
   hb->ld.log[index].accuracy = accuracy;
   hb->ld.log[index].energy = energy_change;
-  if (latency_change == 0) {
-    hb->ld.log[index].global_perf = 0;
-    hb->ld.log[index].window_perf = 0;
-    hb->ld.log[index].instant_perf = 0;
-    hb->ld.log[index].global_acc = 0;
-    hb->ld.log[index].window_acc = 0;
-    hb->ld.log[index].instant_acc = 0;
-    hb->ld.log[index].global_pwr = 0;
-    hb->ld.log[index].window_pwr = 0;
-    hb->ld.log[index].instant_pwr = 0;
-  } else {
-    const double one_billion = 1000000000.0;
-    double total_seconds = ((double) hb->ld.td.total_time) / one_billion;
-    double window_seconds = ((double) hb->ld.td.window_time) / one_billion;
-    double instant_seconds = ((double) latency_change) / one_billion;
-    hb->ld.log[index].global_perf = ((double) hb->ld.wd.total_work) / total_seconds;
-    hb->ld.log[index].window_perf = ((double) hb->ld.wd.window_work) / window_seconds;
-    hb->ld.log[index].instant_perf = ((double) work) / instant_seconds;
-    hb->ld.log[index].global_acc = hb->ld.ad.total_accuracy / total_seconds;
-    hb->ld.log[index].window_acc = hb->ld.ad.window_accuracy / window_seconds;
-    hb->ld.log[index].instant_acc = accuracy / instant_seconds;
-    hb->ld.log[index].global_pwr = hb->ld.ed.total_energy / total_seconds;
-    hb->ld.log[index].window_pwr = hb->ld.ed.window_energy / window_seconds;
-    hb->ld.log[index].instant_pwr = energy_change / instant_seconds;
+  hb->ld.log[index].cpu_time = cpu_change;
+  hb->ld.log[index].vcsw = vcsw_change;
+  hb->ld.log[index].ivcsw = ivcsw_change;
+  hb_totals totals = {
+    hb->ld.td.total_time, hb->ld.td.window_time,
+    hb->ld.sn.total_active, hb->ld.sn.window_active,
+    hb->ld.wd.total_work, hb->ld.wd.window_work,
+    hb->ld.ad.total_accuracy, hb->ld.ad.window_accuracy,
+    hb->ld.ed.total_energy, hb->ld.ed.window_energy,
+    hb->ld.cd.total_cpu_time, hb->ld.cd.window_cpu_time
+  };
+  set_rates(&hb->ld.log[index], &totals);
+
+  process_energy_domains(hb, index, domain_energy, first, time, latency_change);
+  if (++hb->ld.window_index == hb->window_size) {
+    hb->ld.window_index = 0;
+  }
+  if (!first) {
+    // the first heartbeat has no interval to account for
+    hb_rollup_append(hb, &hb->ld.log[index]);
+  }
+  hb->ld.ph.changed = 0;
+  if (hb->ld.ph.enabled && latency_change > 0) {
+    hb->ld.ph.changed = hb_detect_phase(hb, &hb->ld.log[index]);
+  }
+
+  // publish the record only once it's complete
+  hb->ld.read_index = index;
+  __atomic_store_n(&hb->ld.buffer_index, index + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&hb->ld.seq, hb->ld.seq + 1, __ATOMIC_RELEASE);
+
+  if (hb->ld.state_map != NULL) {
+    hb_sync_state(hb, index);
+  }
+  if (hb->ld.hs != NULL) {
+    hb_history_append(hb, &hb->ld.log[index]);
+  }
+  if (hb->ld.ct.enabled && ++hb->ld.ct.window_count >= hb->window_size) {
+    hb->ld.ct.window_count = 0;
+    hb_control(hb, &hb->ld.log[index]);
+  }
+  if (hb->ld.ev.enabled) {
+    hb_check_events(hb, &hb->ld.log[index]);
   }
 
   // check circular buffer, write to file if full
+  // readers aren't blocked while writing, only while resetting the index
   if (hb->ld.buffer_index % hb->ld.buffer_depth == 0) {
     hb_flush_buffer(hb);
+    __atomic_store_n(&hb->ld.seq, hb->ld.seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
     hb->ld.buffer_index = 0;
+    __atomic_store_n(&hb->ld.seq, hb->ld.seq + 1, __ATOMIC_RELEASE);
   }
 }
 
-static inline int64_t get_time() {
+static inline int64_t get_clock_time() {
   struct timespec time_info;
   clock_gettime(CLOCK_REALTIME, &time_info);
   return (int64_t) time_info.tv_sec * 1000000000 + (int64_t) time_info.tv_nsec;
 }
 
-int64_t heartbeat_acc(heartbeat_t* hb,
-                      uint64_t user_tag,
-                      uint64_t work,
-                      double accuracy,
-                      const heartbeat_t* hb_prev) {
-#ifdef HEARTBEAT_USE_PTHREADS_LOCK
-  pthread_mutex_lock(&hb->sd->mutex);
-#endif
-  int64_t time = get_time();
-  if (hb_prev != NULL && hb_prev->ld.valid) {
+static inline int64_t get_time() {
+  int64_t time = __atomic_load_n(&hb_tick.now, __ATOMIC_RELAXED);
+  return time > 0 ? time : get_clock_time();
+}
+
+static void* hb_tick_thread(void* arg) {
+  int64_t resolution = hb_tick_ctl.resolution;
+  struct timespec ts;
+  int64_t now;
+  int64_t next = get_clock_time();
+  ts.tv_sec = resolution / 1000000000;
+  ts.tv_nsec = resolution % 1000000000;
+  while (__atomic_load_n(&hb_tick_ctl.running, __ATOMIC_ACQUIRE)) {
+    now = get_clock_time();
+    if (resolution < HEARTBEAT_TICK_SPIN_THRESHOLD) {
+      // sleeping can't achieve the resolution, so spin until the next tick
+      if (now < next) {
+        continue;
+      }
+      next = now + resolution;
+      __atomic_store_n(&hb_tick.now, now, __ATOMIC_RELAXED);
+    } else {
+      __atomic_store_n(&hb_tick.now, now, __ATOMIC_RELAXED);
+      nanosleep(&ts, NULL);
+    }
+  }
+  return NULL;
+}
+
+int hb_tick_clock_start(int64_t resolution) {
+  int ret = -1;
+  if (resolution <= 0) {
+    fprintf(stderr, "Tick clock resolution must be > 0\n");
+    return -1;
+  }
+  pthread_mutex_lock(&hb_tick_ctl.mutex);
+  if (!hb_tick_ctl.running) {
+    hb_tick_ctl.resolution = resolution;
+    hb_tick_ctl.running = 1;
+    // publish a valid time before any heartbeat can read it
+    __atomic_store_n(&hb_tick.now, get_clock_time(), __ATOMIC_RELAXED);
+    if (pthread_create(&hb_tick_ctl.thread, NULL, &hb_tick_thread, NULL)) {
+      perror("Failed to create heartbeat tick clock thread");
+      hb_tick_ctl.running = 0;
+      __atomic_store_n(&hb_tick.now, 0, __ATOMIC_RELAXED);
+    } else {
+      ret = 0;
+    }
+  }
+  pthread_mutex_unlock(&hb_tick_ctl.mutex);
+  return ret;
+}
+
+void hb_tick_clock_stop(void) {
+  pthread_mutex_lock(&hb_tick_ctl.mutex);
+  if (hb_tick_ctl.running) {
+    __atomic_store_n(&hb_tick_ctl.running, 0, __ATOMIC_RELEASE);
+    pthread_join(hb_tick_ctl.thread, NULL);
+    __atomic_store_n(&hb_tick.now, 0, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&hb_tick_ctl.mutex);
+}
+
+static inline int64_t get_cpu_time() {
+  struct timespec time_info;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time_info);
+  return (int64_t) time_info.tv_sec * 1000000000 + (int64_t) time_info.tv_nsec;
+}
+
+/**
+ * Read the calling thread's CPU statistics enabled in flags.
+ * Returns 0 on success.
+ */
+static inline int get_cpu_stats(int flags,
+                                int64_t* cpu_time,
+                                uint64_t* vcsw,
+                                uint64_t* ivcsw) {
+  struct rusage usage;
+  *cpu_time = 0;
+  *vcsw = 0;
+  *ivcsw = 0;
+  if (flags & HEARTBEAT_CPU_TIME) {
+    *cpu_time = get_cpu_time();
+  }
+  if (flags & HEARTBEAT_CPU_CTX_SWITCHES) {
+    if (getrusage(RUSAGE_THREAD, &usage)) {
+      return -1;
+    }
+    *vcsw = (uint64_t) usage.ru_nvcsw;
+    *ivcsw = (uint64_t) usage.ru_nivcsw;
+  }
+  return 0;
+}
+
+int hb_set_cpu_stats(heartbeat_t* hb, int flags) {
+  // baseline so the first beat after enabling doesn't report the thread's
+  // entire history
+  if (get_cpu_stats(flags, &hb->ld.cd.last_cpu_time, &hb->ld.cd.last_vcsw,
+                    &hb->ld.cd.last_ivcsw)) {
+    perror("Failed to read heartbeat thread CPU statistics");
+    return -1;
+  }
+  hb->ld.cd.flags = flags;
+  return 0;
+}
+
+/**
+ * Read the clock for the period check every 1/256 of an interval, rounded
+ * down to a power of 2 so the check is a mask.
+ */
+static inline void set_check_mask(_heartbeat_sampling_data* sp) {
+  uint64_t k = sp->interval / 256;
+  sp->check_mask = k == 0 ? 0 : (1ULL << (63 - __builtin_clzll(k))) - 1;
+}
+
+void hb_set_sampling(heartbeat_t* hb,
+                     uint64_t interval,
+                     int64_t period,
+                     double budget) {
+  init_sampling_data(&hb->ld.sp);
+  hb->ld.sp.interval = interval;
+  hb->ld.sp.min_interval = period > 0 ? 1 : interval;
+  hb->ld.sp.period = period;
+  hb->ld.sp.budget = budget;
+  set_check_mask(&hb->ld.sp);
+}
+
+/**
+ * Adjust the sampling interval after taking a record.
+ * elapsed is the time since the previous record, cost the time spent
+ * taking this one.
+ */
+static inline void adjust_sampling(_heartbeat_sampling_data* sp,
+                                   int64_t elapsed,
+                                   int64_t cost) {
+  uint64_t interval = sp->interval;
+  if (elapsed <= 0) {
+    return;
+  }
+  if (sp->period > 0) {
+    // scale toward the target period, but at most by a factor of 2
+    // the record may have been forced by the period before interval beats
+    interval = (uint64_t) (((double) sp->beats) * sp->period / elapsed);
+    if (interval > sp->interval * 2) {
+      interval = sp->interval * 2;
+    } else if (interval < sp->interval / 2) {
+      interval = sp->interval / 2;
+    }
+  }
+  if (sp->budget > 0) {
+    if (cost > sp->budget * elapsed) {
+      // over budget - back off
+      if (interval < sp->interval * 2) {
+        interval = sp->interval * 2;
+      }
+    } else if (sp->period <= 0 && cost < sp->budget * elapsed / 4) {
+      // comfortably under budget - regain resolution
+      interval = sp->interval / 2;
+    }
+  }
+  sp->interval = interval < sp->min_interval ? sp->min_interval : interval;
+  if (sp->interval == 0) {
+    sp->interval = 1;
+  }
+  set_check_mask(sp);
+}
+
+/**
+ * Choose the predecessor the heartbeat's latency is measured from, see
+ * heartbeat_acc_join(). Returns its index, or -1 to measure from the
+ * heartbeat's own previous beat.
+ */
+static inline int hb_select_prev(const heartbeat_t* hb,
+                                 const heartbeat_t* const* hb_prevs,
+                                 unsigned int nprevs,
+                                 int policy) {
+  int critical = -1;
+  int64_t best = 0;
+  int64_t t;
+  unsigned int i;
+  for (i = 0; i < nprevs; i++) {
+    if (hb_prevs[i] == NULL || !hb_prevs[i]->ld.valid) {
+      if (policy == HEARTBEAT_PREV_ALL) {
+        return -1;
+      }
+      continue;
+    }
+    t = hb_prevs[i]->ld.td.last_timestamp;
+    if (policy != HEARTBEAT_PREV_LATEST && hb->ld.valid &&
+        t < hb->ld.td.last_timestamp) {
+      // not a new input since our last heartbeat
+      if (policy == HEARTBEAT_PREV_ALL) {
+        return -1;
+      }
+      continue;
+    }
+    if (critical < 0 || (policy == HEARTBEAT_PREV_EARLIEST ? t < best : t > best)) {
+      critical = (int) i;
+      best = t;
+    }
+  }
+  return critical;
+}
+
+/**
+ * Returns non-zero if a period is set and has passed since the last record.
+ * Reading the tick clock is just a load, so it's checked every beat while
+ * the clock runs; otherwise only every check_mask + 1 beats.
+ */
+static inline int hb_period_due(const _heartbeat_sampling_data* sp) {
+  if (sp->period <= 0 || sp->last_time < 0 ||
+      ((sp->pending & sp->check_mask) != 0 &&
+       __atomic_load_n(&hb_tick.now, __ATOMIC_RELAXED) <= 0)) {
+    return 0;
+  }
+  return get_time() - sp->last_time >= sp->period;
+}
+
+/**
+ * In sampling mode, accumulate a beat. Returns 1 if a record is due, with
+ * work and accuracy set to the totals since the last record.
+ * A record is due on the first beat, which starts the first interval, after
+ * interval beats, or once period has passed since the last one so that a
+ * slowdown doesn't leave records far apart.
+ */
+static inline int hb_sample(heartbeat_t* hb, uint64_t* work, double* accuracy) {
+  if (hb->ld.sp.interval > 0) {
+    // sampling mode - only accumulate until the next record is due
+    hb->ld.sp.pending++;
+    hb->ld.sp.pending_work += *work;
+    hb->ld.sp.pending_accuracy += *accuracy;
+    if (hb->ld.valid && hb->ld.sp.pending < hb->ld.sp.interval &&
+        !hb_period_due(&hb->ld.sp)) {
+      return 0;
+    }
+    *work = hb->ld.sp.pending_work;
+    *accuracy = hb->ld.sp.pending_accuracy;
+    hb->ld.sp.beats = hb->ld.sp.pending;
+    hb->ld.sp.pending = 0;
+    hb->ld.sp.pending_work = 0;
+    hb->ld.sp.pending_accuracy = 0;
+  }
+  return 1;
+}
+
+/**
+ * Start the heartbeat's deltas from the chosen predecessor's last values.
+ * Returns the predecessor's index, or -1 if none was used.
+ */
+static inline int hb_use_prev(heartbeat_t* hb,
+                              const heartbeat_t* const* hb_prevs,
+                              unsigned int nprevs,
+                              int policy) {
+  const heartbeat_t* hb_prev;
+  int critical = hb_select_prev(hb, hb_prevs, nprevs, policy);
+  if (critical >= 0) {
     // update local data based on previous heartbeat
+    hb_prev = hb_prevs[critical];
     hb->ld.td.last_timestamp = hb_prev->ld.td.last_timestamp;
     hb->ld.ed.last_energy = hb_prev->ld.ed.last_energy;
+    hb->ld.ed.last_change = hb_prev->ld.ed.last_change;
+    if (hb->ld.domain_count == hb_prev->ld.domain_count) {
+      memcpy(hb->ld.ed.domain_last_energy, hb_prev->ld.ed.domain_last_energy,
+             sizeof(hb->ld.ed.domain_last_energy));
+      memcpy(hb->ld.ed.domain_last_change, hb_prev->ld.ed.domain_last_change,
+             sizeof(hb->ld.ed.domain_last_change));
+    }
+    // only meaningful if hb_prev is issued from the same thread
+    if (hb->ld.cd.flags != 0 &&
+        (hb_prev->ld.cd.flags & hb->ld.cd.flags) == hb->ld.cd.flags) {
+      hb->ld.cd.last_cpu_time = hb_prev->ld.cd.last_cpu_time;
+      hb->ld.cd.last_vcsw = hb_prev->ld.cd.last_vcsw;
+      hb->ld.cd.last_ivcsw = hb_prev->ld.cd.last_ivcsw;
+    }
   }
+  return critical;
+}
+
+static inline void hb_read_domains(const heartbeat_t* hb, double* domain_energy) {
+  unsigned int d;
+  // get data in microjoules and convert to joules
+  for (d = 0; d < hb->ld.domain_count; d++) {
+    domain_energy[d] = hb->ld.domains[d].ef(hb->ld.domains[d].ref_arg) / 1000000.0;
+  }
+}
+
+/**
+ * Update the sampling interval after a record was written at time.
+ */
+static inline void hb_sampled(heartbeat_t* hb, int64_t time) {
+  int64_t elapsed = 0;
+  if (hb->ld.sp.interval > 0) {
+    if (hb->ld.sp.last_time >= 0) {
+      elapsed = time - hb->ld.sp.last_time;
+    }
+    hb->ld.sp.last_time = time;
+    adjust_sampling(&hb->ld.sp, elapsed,
+                    hb->ld.sp.budget > 0 ? get_time() - time : 0);
+  }
+}
+
+static int64_t hb_beat(heartbeat_t* hb,
+                       uint64_t user_tag,
+                       uint64_t work,
+                       double accuracy,
+                       const heartbeat_t* const* hb_prevs,
+                       unsigned int nprevs,
+                       int policy) {
+  int critical;
+  if (!hb_sample(hb, &work, &accuracy)) {
+    return hb->ld.td.last_timestamp;
+  }
+#ifdef HEARTBEAT_USE_PTHREADS_LOCK
+  hb_lock(hb->sd);
+#endif
+  int64_t time = get_time();
+  int64_t cpu_time;
+  uint64_t vcsw;
+  uint64_t ivcsw;
+  critical = hb_use_prev(hb, hb_prevs, nprevs, policy);
   // get data in microjoules and convert to joules
   double energy = hb->ld.ef == NULL ? 0.0 : hb->ld.ef(hb->ld.ref_arg) / 1000000.0;
-  process_heartbeat(hb, user_tag, work, accuracy, time, energy);
+  double domain_energy[HEARTBEAT_ENERGY_DOMAINS_MAX];
+  hb_read_domains(hb, domain_energy);
+  // failures leave the previous values so the deltas are just 0
+  if (get_cpu_stats(hb->ld.cd.flags, &cpu_time, &vcsw, &ivcsw)) {
+    cpu_time = hb->ld.cd.last_cpu_time;
+    vcsw = hb->ld.cd.last_vcsw;
+    ivcsw = hb->ld.cd.last_ivcsw;
+  }
+  process_heartbeat(hb, user_tag, work, accuracy, time, energy, domain_energy,
+                    cpu_time, vcsw, ivcsw, critical);
+  hb_sampled(hb, time);
 #ifdef HEARTBEAT_USE_PTHREADS_LOCK
   pthread_mutex_unlock(&hb->sd->mutex);
 #endif
   return time;
 }
 
+static inline int hb_same_domains(const heartbeat_t* a, const heartbeat_t* b) {
+  unsigned int d;
+  if (a->ld.domain_count != b->ld.domain_count) {
+    return 0;
+  }
+  for (d = 0; d < a->ld.domain_count; d++) {
+    if (a->ld.domains[d].ef != b->ld.domains[d].ef ||
+        a->ld.domains[d].ref_arg != b->ld.domains[d].ref_arg) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int64_t heartbeat_acc_group(heartbeat_t* const* hbs,
+                            unsigned int n,
+                            uint64_t user_tag,
+                            const uint64_t* work,
+                            const double* accuracy,
+                            const heartbeat_t* const* hb_prevs) {
+  const heartbeat_t* sampled = NULL;
+  heartbeat_t* hb;
+  uint64_t w;
+  double acc;
+  int critical;
+  int cpu_failed = 0;
+  int64_t cpu_time = 0;
+  uint64_t vcsw = 0;
+  uint64_t ivcsw = 0;
+  double energy = 0;
+  double domain_energy[HEARTBEAT_ENERGY_DOMAINS_MAX];
+  unsigned int i;
+  if (n == 0) {
+    return 0;
+  }
+#ifdef HEARTBEAT_USE_PTHREADS_LOCK
+  _heartbeat_shared_data* locked = hbs[0]->sd;
+  hb_lock(locked);
+#endif
+  int64_t time = get_time();
+  for (i = 0; i < n; i++) {
+    hb = hbs[i];
+    w = work[i];
+    acc = accuracy == NULL ? HEARTBEAT_ACCURACY_DEFAULT : accuracy[i];
+    if (!hb_sample(hb, &w, &acc)) {
+      continue;
+    }
+#ifdef HEARTBEAT_USE_PTHREADS_LOCK
+    // heartbeats in other trees need their own lock
+    if (hb->sd != locked) {
+      pthread_mutex_unlock(&locked->mutex);
+      locked = hb->sd;
+      hb_lock(locked);
+    }
+#endif
+    critical = hb_use_prev(hb, hb_prevs == NULL ? NULL : &hb_prevs[i],
+                           hb_prevs != NULL && hb_prevs[i] != NULL,
+                           HEARTBEAT_PREV_LATEST);
+    // sample each source once, heartbeats usually share them
+    if (sampled == NULL || sampled->ld.ef != hb->ld.ef ||
+        sampled->ld.ref_arg != hb->ld.ref_arg) {
+      energy = hb->ld.ef == NULL ? 0.0 : hb->ld.ef(hb->ld.ref_arg) / 1000000.0;
+    }
+    if (sampled == NULL || !hb_same_domains(sampled, hb)) {
+      hb_read_domains(hb, domain_energy);
+    }
+    if (sampled == NULL || sampled->ld.cd.flags != hb->ld.cd.flags) {
+      cpu_failed = get_cpu_stats(hb->ld.cd.flags, &cpu_time, &vcsw, &ivcsw);
+    }
+    sampled = hb;
+    // failures leave the previous values so the deltas are just 0
+    process_heartbeat(hb, user_tag, w, acc, time, energy, domain_energy,
+                      cpu_failed ? hb->ld.cd.last_cpu_time : cpu_time,
+                      cpu_failed ? hb->ld.cd.last_vcsw : vcsw,
+                      cpu_failed ? hb->ld.cd.last_ivcsw : ivcsw,
+                      critical);
+    hb_sampled(hb, time);
+  }
+#ifdef HEARTBEAT_USE_PTHREADS_LOCK
+  pthread_mutex_unlock(&locked->mutex);
+#endif
+  return time;
+}
+
+int64_t heartbeat_acc(heartbeat_t* hb,
+                      uint64_t user_tag,
+                      uint64_t work,
+                      double accuracy,
+                      const heartbeat_t* hb_prev) {
+  return hb_beat(hb, user_tag, work, accuracy, &hb_prev, hb_prev != NULL,
+                 HEARTBEAT_PREV_LATEST);
+}
+
+int64_t heartbeat_begin(heartbeat_t* hb) {
+  hb->ld.sn.begin = get_time();
+  return hb->ld.sn.begin;
+}
+
+/**
+ * Close the open span, if any, adding its time to the next record.
+ */
+static inline void hb_end_span(heartbeat_t* hb) {
+  int64_t active;
+  if (hb->ld.sn.begin >= 0) {
+    active = get_time() - hb->ld.sn.begin;
+    // the clock may step backward, never count negative time
+    hb->ld.sn.active += active > 0 ? active : 0;
+    hb->ld.sn.spans++;
+    hb->ld.sn.begin = -1;
+  }
+}
+
+int64_t heartbeat_acc_end(heartbeat_t* hb,
+                          uint64_t user_tag,
+                          uint64_t work,
+                          double accuracy) {
+  hb_end_span(hb);
+  return hb_beat(hb, user_tag, work, accuracy, NULL, 0, HEARTBEAT_PREV_LATEST);
+}
+
+int64_t heartbeat_acc_join(heartbeat_t* hb,
+                           uint64_t user_tag,
+                           uint64_t work,
+                           double accuracy,
+                           const heartbeat_t* const* hb_prevs,
+                           unsigned int nprevs,
+                           int policy) {
+  return hb_beat(hb, user_tag, work, accuracy, hb_prevs, nprevs, policy);
+}
+
 int64_t heartbeat(heartbeat_t* hb,
                   uint64_t user_tag,
                   uint64_t work,
                   const heartbeat_t* hb_prev) {
   return heartbeat_acc(hb, user_tag, work, HEARTBEAT_ACCURACY_DEFAULT, hb_prev);
 }
+
+int64_t heartbeat_end(heartbeat_t* hb,
+                      uint64_t user_tag,
+                      uint64_t work) {
+  return heartbeat_acc_end(hb, user_tag, work, HEARTBEAT_ACCURACY_DEFAULT);
+}
+
+int64_t heartbeat_group(heartbeat_t* const* hbs,
+                        unsigned int n,
+                        uint64_t user_tag,
+                        const uint64_t* work,
+                        const heartbeat_t* const* hb_prevs) {
+  return heartbeat_acc_group(hbs, n, user_tag, work, NULL, hb_prevs);
+}
+
+int64_t heartbeat_join(heartbeat_t* hb,
+                       uint64_t user_tag,
+                       uint64_t work,
+                       const heartbeat_t* const* hb_prevs,
+                       unsigned int nprevs,
+                       int policy) {
+  return hb_beat(hb, user_tag, work, HEARTBEAT_ACCURACY_DEFAULT, hb_prevs,
+                 nprevs, policy);
+}
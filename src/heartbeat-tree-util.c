@@ -12,6 +12,7 @@
  * @author Hank Hoffmann
  */
 
+#include <stddef.h>
 #include <string.h>
 #include <inttypes.h>
 
@@ -32,6 +33,47 @@
  */
 #if !defined(HEARTBEAT_UTIL_OVERRIDE)
 
+/*
+ * Readers use a sequence lock so they never block the producer: the producer
+ * makes hb->ld.seq odd while it updates a heartbeat and even again once the
+ * record is published, and readers retry if it changed while they were
+ * copying.
+ */
+static inline uint64_t hb_read_begin(const heartbeat_t* hb) {
+  uint64_t seq;
+  while ((seq = __atomic_load_n(&hb->ld.seq, __ATOMIC_ACQUIRE)) & 1);
+  return seq;
+}
+
+static inline uint64_t hb_read_end(const heartbeat_t* hb) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&hb->ld.seq, __ATOMIC_RELAXED);
+}
+
+static inline double hb_read_current_double(const heartbeat_t* hb,
+                                            size_t offset) {
+  uint64_t seq;
+  double val;
+  do {
+    seq = hb_read_begin(hb);
+    memcpy(&val, (const char*) &hb->ld.log[hb->ld.read_index] + offset,
+           sizeof(val));
+  } while (hb_read_end(hb) != seq);
+  return val;
+}
+
+static inline uint64_t hb_read_current_u64(const heartbeat_t* hb,
+                                           size_t offset) {
+  uint64_t seq;
+  uint64_t val;
+  do {
+    seq = hb_read_begin(hb);
+    memcpy(&val, (const char*) &hb->ld.log[hb->ld.read_index] + offset,
+           sizeof(val));
+  } while (hb_read_end(hb) != seq);
+  return val;
+}
+
 heartbeat_t* hb_get_parent(const heartbeat_t* hb) {
   return hb->parent;
 }
@@ -44,13 +86,48 @@ uint64_t hb_get_buffer_depth(const heartbeat_t* hb) {
   return hb->ld.buffer_depth;
 }
 
+uint64_t hb_get_sampling_interval(const heartbeat_t* hb) {
+  return hb->ld.sp.interval;
+}
+
+uint64_t hb_get_time_corrections(const heartbeat_t* hb) {
+  return hb->ld.cr.time_steps;
+}
+
+double hb_get_knob(const heartbeat_t* hb) {
+  return hb->ld.ct.knob;
+}
+
+uint64_t hb_get_phase_count(const heartbeat_t* hb) {
+  return hb->ld.ph.count;
+}
+
+uint64_t hb_get_phases(const heartbeat_t* hb, uint64_t* ids, uint64_t n) {
+  uint64_t seq;
+  uint64_t count;
+  uint64_t ret;
+  uint64_t i;
+  do {
+    seq = hb_read_begin(hb);
+    count = hb->ld.ph.count;
+    ret = n < count ? n : count;
+    if (ret > HEARTBEAT_PHASES_MAX) {
+      ret = HEARTBEAT_PHASES_MAX;
+    }
+    for (i = 0; i < ret; i++) {
+      ids[i] = hb->ld.ph.boundaries[(count - ret + i) % HEARTBEAT_PHASES_MAX];
+    }
+  } while (hb_read_end(hb) != seq);
+  return ret;
+}
+
 void hb_get_current(const heartbeat_t* hb,
                     heartbeat_record_t* record) {
   hb_get_history(hb, record, 1);
 }
 
 uint64_t hb_get_user_tag(const heartbeat_t* hb) {
-  return hb->ld.log[hb->ld.read_index].user_tag;
+  return hb_read_current_u64(hb, offsetof(heartbeat_record_t, user_tag));
 }
 
 int64_t hb_get_global_time(const heartbeat_t* hb) {
@@ -70,63 +147,321 @@ uint64_t hb_get_window_work(const heartbeat_t* hb) {
 }
 
 double hb_get_global_rate(const heartbeat_t* hb) {
-  return hb->ld.log[hb->ld.read_index].global_perf;
+  return hb_read_current_double(hb, offsetof(heartbeat_record_t, global_perf));
 }
 
 double hb_get_window_rate(const heartbeat_t* hb) {
-  return hb->ld.log[hb->ld.read_index].window_perf;
+  return hb_read_current_double(hb, offsetof(heartbeat_record_t, window_perf));
 }
 
 double hb_get_instant_rate(const heartbeat_t* hb) {
-  return hb->ld.log[hb->ld.read_index].instant_perf;
+  return hb_read_current_double(hb, offsetof(heartbeat_record_t, instant_perf));
 }
 
-uint64_t hb_get_history(const heartbeat_t* hb,
-                        heartbeat_record_t* record,
-                        uint64_t n) {
-  if (n == 0) {
-    return 0;
-  }
+int64_t hb_get_global_active_time(const heartbeat_t* hb) {
+  return hb->ld.sn.total_active;
+}
 
-  if (n > hb->ld.counter) {
-    // more records were requested than have been created
-    memcpy(record,
-           &hb->ld.log[0],
-           hb->ld.buffer_index * sizeof(heartbeat_record_t));
-    return hb->ld.buffer_index;
+int64_t hb_get_window_active_time(const heartbeat_t* hb) {
+  return hb->ld.sn.window_active;
+}
+
+double hb_get_global_active_rate(const heartbeat_t* hb) {
+  return hb_read_current_double(hb, offsetof(heartbeat_record_t,
+                                             global_active_perf));
+}
+
+double hb_get_window_active_rate(const heartbeat_t* hb) {
+  return hb_read_current_double(hb, offsetof(heartbeat_record_t,
+                                             window_active_perf));
+}
+
+double hb_get_instant_active_rate(const heartbeat_t* hb) {
+  return hb_read_current_double(hb, offsetof(heartbeat_record_t,
+                                             instant_active_perf));
+}
+
+int64_t hb_get_global_cpu_time(const heartbeat_t* hb) {
+  return hb->ld.cd.total_cpu_time;
+}
+
+int64_t hb_get_window_cpu_time(const heartbeat_t* hb) {
+  return hb->ld.cd.window_cpu_time;
+}
+
+double hb_get_global_cpu_utilization(const heartbeat_t* hb) {
+  return hb_read_current_double(hb, offsetof(heartbeat_record_t, global_cpu));
+}
+
+double hb_get_window_cpu_utilization(const heartbeat_t* hb) {
+  return hb_read_current_double(hb, offsetof(heartbeat_record_t, window_cpu));
+}
+
+double hb_get_instant_cpu_utilization(const heartbeat_t* hb) {
+  return hb_read_current_double(hb, offsetof(heartbeat_record_t, instant_cpu));
+}
+
+/**
+ * Copy the last n records as of the given buffer index and record count.
+ */
+static inline uint64_t hb_copy_history(const heartbeat_t* hb,
+                                       heartbeat_record_t* record,
+                                       uint64_t n,
+                                       uint64_t buffer_index,
+                                       uint64_t counter) {
+  const uint64_t depth = hb->ld.buffer_depth;
+
+  if (n > counter - hb->ld.first_id) {
+    // more records were requested than have been created (or restored)
+    n = counter - hb->ld.first_id;
+    if (n == 0) {
+      return 0;
+    }
   }
 
-  if (hb->ld.buffer_index >= n) {
+  if (buffer_index >= n) {
     // the number of records requested do not overflow the circular buffer
     memcpy(record,
-           &hb->ld.log[hb->ld.buffer_index - n],
+           &hb->ld.log[buffer_index - n],
            n * sizeof(heartbeat_record_t));
     return n;
   }
 
   // the number of records requested could overflow the circular buffer
-  if (n >= hb->ld.buffer_depth) {
+  if (n >= depth) {
     // more records were requested than we can support, return what we have
     memcpy(record,
-         &hb->ld.log[hb->ld.buffer_index],
-         (hb->ld.buffer_depth - hb->ld.buffer_index) * sizeof(heartbeat_record_t));
-    memcpy(record + hb->ld.buffer_depth - hb->ld.buffer_index,
+         &hb->ld.log[buffer_index],
+         (depth - buffer_index) * sizeof(heartbeat_record_t));
+    memcpy(record + depth - buffer_index,
            &hb->ld.log[0],
-           hb->ld.buffer_index * sizeof(heartbeat_record_t));
-    return hb->ld.buffer_depth;
+           buffer_index * sizeof(heartbeat_record_t));
+    return depth;
   }
 
   // buffer_index < n < buffer_depth
   // still overflows circular buffer, but we don't want all records
   memcpy(record,
-         &hb->ld.log[hb->ld.buffer_depth + hb->ld.buffer_index - n],
-         (n - hb->ld.buffer_index) * sizeof(heartbeat_record_t));
-  memcpy(record + n - hb->ld.buffer_index,
+         &hb->ld.log[depth + buffer_index - n],
+         (n - buffer_index) * sizeof(heartbeat_record_t));
+  memcpy(record + n - buffer_index,
          &hb->ld.log[0],
-         hb->ld.buffer_index * sizeof(heartbeat_record_t));
+         buffer_index * sizeof(heartbeat_record_t));
+  return n;
+}
+
+uint64_t hb_get_history(const heartbeat_t* hb,
+                        heartbeat_record_t* record,
+                        uint64_t n) {
+  uint64_t seq;
+  uint64_t ret;
+  uint64_t writes;
+  uint64_t torn;
+
+  if (n == 0) {
+    return 0;
+  }
+
+  for (;;) {
+    seq = hb_read_begin(hb);
+    ret = hb_copy_history(hb, record, n,
+                          __atomic_load_n(&hb->ld.buffer_index, __ATOMIC_ACQUIRE),
+                          hb->ld.counter);
+    writes = (hb_read_end(hb) - seq + 1) / 2;
+    if (writes == 0) {
+      return ret;
+    }
+    // The producer only writes slots at and after the buffer index we read,
+    // which hold the oldest records we copied. Rather than retrying (and
+    // possibly starving at high heart rates), drop any that may be torn.
+    if (writes <= hb->ld.buffer_depth - ret) {
+      return ret;
+    }
+    torn = writes - (hb->ld.buffer_depth - ret);
+    if (torn < ret) {
+      memmove(record, record + torn, (ret - torn) * sizeof(heartbeat_record_t));
+      return ret - torn;
+    }
+  }
+}
+
+uint64_t hb_get_history_view(const heartbeat_t* hb,
+                             uint64_t n,
+                             heartbeat_history_view_t* view) {
+  const uint64_t depth = hb->ld.buffer_depth;
+  uint64_t buffer_index;
+  uint64_t counter;
+  uint64_t first_id;
+  do {
+    view->seq = hb_read_begin(hb);
+    buffer_index = __atomic_load_n(&hb->ld.buffer_index, __ATOMIC_ACQUIRE);
+    counter = hb->ld.counter;
+    first_id = hb->ld.first_id;
+  } while (hb_read_end(hb) != view->seq);
+
+  if (n > counter - first_id) {
+    n = counter - first_id;
+  }
+  if (n > depth) {
+    n = depth;
+  }
+  if (buffer_index >= n) {
+    view->records[0] = &hb->ld.log[buffer_index - n];
+    view->count[0] = n;
+    view->records[1] = hb->ld.log;
+    view->count[1] = 0;
+  } else {
+    // wraps around the end of the circular buffer
+    view->records[0] = &hb->ld.log[depth + buffer_index - n];
+    view->count[0] = n - buffer_index;
+    view->records[1] = hb->ld.log;
+    view->count[1] = buffer_index;
+  }
   return n;
 }
 
+uint64_t hb_check_history_view(const heartbeat_t* hb,
+                               const heartbeat_history_view_t* view) {
+  const uint64_t n = view->count[0] + view->count[1];
+  uint64_t writes = (hb_read_end(hb) - view->seq + 1) / 2;
+  // same reasoning as hb_get_history()
+  if (writes <= hb->ld.buffer_depth - n) {
+    return 0;
+  }
+  writes -= hb->ld.buffer_depth - n;
+  return writes < n ? writes : n;
+}
+
+static inline double hb_get_field(const heartbeat_record_t* hbr,
+                                  size_t offset,
+                                  int type) {
+  const char* p = (const char*) hbr + offset;
+  int64_t i;
+  uint64_t u;
+  double d;
+  switch (type) {
+    case HEARTBEAT_FIELD_INT64:
+      memcpy(&i, p, sizeof(i));
+      return (double) i;
+    case HEARTBEAT_FIELD_UINT64:
+      memcpy(&u, p, sizeof(u));
+      return (double) u;
+    default:
+      memcpy(&d, p, sizeof(d));
+      return d;
+  }
+}
+
+/*
+ * Fields are strided by the record size, so rather than SIMD loads the
+ * loops keep four independent accumulators to overlap consecutive records'
+ * loads and adds instead of serializing on one dependency chain. Called
+ * with a constant type so each is specialized per field type.
+ */
+static inline void hb_field_run(const heartbeat_record_t* hbr,
+                                uint64_t n,
+                                size_t offset,
+                                int type,
+                                heartbeat_field_stats_t* stats) {
+  double sum[4] = { 0, 0, 0, 0 };
+  double min[4];
+  double max[4];
+  double v;
+  uint64_t i;
+  unsigned int j;
+  if (n == 0) {
+    return;
+  }
+  for (j = 0; j < 4; j++) {
+    min[j] = max[j] = hb_get_field(hbr, offset, type);
+  }
+  for (i = 0; i + 4 <= n; i += 4) {
+    for (j = 0; j < 4; j++) {
+      v = hb_get_field(&hbr[i + j], offset, type);
+      sum[j] += v;
+      min[j] = v < min[j] ? v : min[j];
+      max[j] = v > max[j] ? v : max[j];
+    }
+  }
+  for (; i < n; i++) {
+    v = hb_get_field(&hbr[i], offset, type);
+    sum[0] += v;
+    min[0] = v < min[0] ? v : min[0];
+    max[0] = v > max[0] ? v : max[0];
+  }
+  for (j = 1; j < 4; j++) {
+    min[0] = min[j] < min[0] ? min[j] : min[0];
+    max[0] = max[j] > max[0] ? max[j] : max[0];
+  }
+  if (stats->count == 0 || min[0] < stats->min) {
+    stats->min = min[0];
+  }
+  if (stats->count == 0 || max[0] > stats->max) {
+    stats->max = max[0];
+  }
+  stats->sum += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+  stats->count += n;
+}
+
+static inline double hb_field_run_squares(const heartbeat_record_t* hbr,
+                                          uint64_t n,
+                                          size_t offset,
+                                          int type,
+                                          double mean) {
+  double sum[4] = { 0, 0, 0, 0 };
+  double v;
+  uint64_t i;
+  unsigned int j;
+  for (i = 0; i + 4 <= n; i += 4) {
+    for (j = 0; j < 4; j++) {
+      v = hb_get_field(&hbr[i + j], offset, type) - mean;
+      sum[j] += v * v;
+    }
+  }
+  for (; i < n; i++) {
+    v = hb_get_field(&hbr[i], offset, type) - mean;
+    sum[0] += v * v;
+  }
+  return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+}
+
+static inline void hb_field_stats(const heartbeat_history_view_t* view,
+                                  size_t offset,
+                                  int type,
+                                  heartbeat_field_stats_t* stats) {
+  double squares;
+  hb_field_run(view->records[0], view->count[0], offset, type, stats);
+  hb_field_run(view->records[1], view->count[1], offset, type, stats);
+  if (stats->count == 0) {
+    return;
+  }
+  // a second pass around the mean is more accurate than sums of squares
+  stats->mean = stats->sum / stats->count;
+  squares = hb_field_run_squares(view->records[0], view->count[0], offset,
+                                 type, stats->mean) +
+            hb_field_run_squares(view->records[1], view->count[1], offset,
+                                 type, stats->mean);
+  stats->variance = squares / stats->count;
+}
+
+void hb_get_field_stats(const heartbeat_history_view_t* view,
+                        size_t offset,
+                        int type,
+                        heartbeat_field_stats_t* stats) {
+  memset(stats, 0, sizeof(heartbeat_field_stats_t));
+  switch (type) {
+    case HEARTBEAT_FIELD_INT64:
+      hb_field_stats(view, offset, HEARTBEAT_FIELD_INT64, stats);
+      break;
+    case HEARTBEAT_FIELD_UINT64:
+      hb_field_stats(view, offset, HEARTBEAT_FIELD_UINT64, stats);
+      break;
+    default:
+      hb_field_stats(view, offset, HEARTBEAT_FIELD_DOUBLE, stats);
+      break;
+  }
+}
+
 uint64_t hbr_get_beat_number(const heartbeat_record_t* hbr) {
   return hbr->id;
 }
@@ -143,6 +478,10 @@ int64_t hbr_get_timestamp(const heartbeat_record_t* hbr) {
   return hbr->timestamp;
 }
 
+int64_t hbr_get_critical_prev(const heartbeat_record_t* hbr) {
+  return hbr->critical;
+}
+
 uint64_t hbr_get_work(const heartbeat_record_t* hbr) {
   return hbr->work;
 }
@@ -163,6 +502,77 @@ double hbr_get_instant_rate(const heartbeat_record_t* hbr) {
   return hbr->instant_perf;
 }
 
+int64_t hbr_get_active_time(const heartbeat_record_t* hbr) {
+  return hbr->active;
+}
+
+double hbr_get_global_active_rate(const heartbeat_record_t* hbr) {
+  return hbr->global_active_perf;
+}
+
+double hbr_get_window_active_rate(const heartbeat_record_t* hbr) {
+  return hbr->window_active_perf;
+}
+
+double hbr_get_instant_active_rate(const heartbeat_record_t* hbr) {
+  return hbr->instant_active_perf;
+}
+
+int64_t hbr_get_cpu_time(const heartbeat_record_t* hbr) {
+  return hbr->cpu_time;
+}
+
+uint64_t hbr_get_voluntary_ctx_switches(const heartbeat_record_t* hbr) {
+  return hbr->vcsw;
+}
+
+uint64_t hbr_get_involuntary_ctx_switches(const heartbeat_record_t* hbr) {
+  return hbr->ivcsw;
+}
+
+double hbr_get_global_cpu_utilization(const heartbeat_record_t* hbr) {
+  return hbr->global_cpu;
+}
+
+double hbr_get_window_cpu_utilization(const heartbeat_record_t* hbr) {
+  return hbr->window_cpu;
+}
+
+double hbr_get_instant_cpu_utilization(const heartbeat_record_t* hbr) {
+  return hbr->instant_cpu;
+}
+
+int64_t hbru_get_start(const heartbeat_rollup_t* hbru) {
+  return hbru->start;
+}
+
+uint64_t hbru_get_count(const heartbeat_rollup_t* hbru) {
+  return hbru->count;
+}
+
+uint64_t hbru_get_work(const heartbeat_rollup_t* hbru) {
+  return hbru->work;
+}
+
+int64_t hbru_get_time(const heartbeat_rollup_t* hbru) {
+  return hbru->time;
+}
+
+int64_t hbru_get_min_latency(const heartbeat_rollup_t* hbru) {
+  return hbru->min_latency;
+}
+
+int64_t hbru_get_max_latency(const heartbeat_rollup_t* hbru) {
+  return hbru->max_latency;
+}
+
+double hbru_get_rate(const heartbeat_rollup_t* hbru) {
+  if (hbru->time == 0) {
+    return 0;
+  }
+  return hbru->work / (hbru->time / 1000000000.0);
+}
+
 #endif
 
 /*
@@ -179,15 +589,15 @@ double hb_get_window_accuracy(const heartbeat_t* hb) {
 }
 
 double hb_get_global_accuracy(const heartbeat_t* hb) {
-  return hb->ld.log[hb->ld.read_index].global_acc;
+  return hb_read_current_double(hb, offsetof(heartbeat_record_t, global_acc));
 }
 
 double hb_get_window_accuracy(const heartbeat_t* hb) {
-  return hb->ld.log[hb->ld.read_index].window_acc;
+  return hb_read_current_double(hb, offsetof(heartbeat_record_t, window_acc));
 }
 
 double hb_get_instant_accuracy(const heartbeat_t* hb) {
-  return hb->ld.log[hb->ld.read_index].instant_acc;
+  return hb_read_current_double(hb, offsetof(heartbeat_record_t, instant_acc));
 }
 
 double hbr_get_accuracy(const heartbeat_record_t* hbr) {
@@ -208,6 +618,18 @@ double hbr_get_instant_accuracy(const heartbeat_record_t* hbr) {
 
 #endif
 
+/*
+ * Functions from heartbeat-tree-accuracy.h for both accuracy modes
+ */
+#if (defined(HEARTBEAT_MODE_ACC) || defined(HEARTBEAT_MODE_ACC_POW)) && \
+    !defined(HEARTBEAT_ACCURACY_UTIL_OVERRIDE)
+
+double hbru_get_accuracy(const heartbeat_rollup_t* hbru) {
+  return hbru->accuracy;
+}
+
+#endif
+
 /*
  * Functions from heartbeat-tree-accuracy-power.h
  */
@@ -221,22 +643,101 @@ double hb_get_window_energy(const heartbeat_t* hb) {
   return hb->ld.ed.window_energy;
 }
 
+uint64_t hb_get_energy_wraps(const heartbeat_t* hb) {
+  return hb->ld.cr.energy_wraps;
+}
+
+uint64_t hb_get_energy_outliers(const heartbeat_t* hb) {
+  return hb->ld.cr.energy_outliers;
+}
+
+unsigned int hb_get_energy_domain_count(const heartbeat_t* hb) {
+  return hb->ld.domain_count;
+}
+
+const char* hb_get_energy_domain_name(const heartbeat_t* hb,
+                                      unsigned int domain) {
+  return domain < hb->ld.domain_count ? hb->ld.domains[domain].name : NULL;
+}
+
+double hb_get_global_domain_energy(const heartbeat_t* hb, unsigned int domain) {
+  return domain < hb->ld.domain_count ? hb->ld.ed.domain_total_energy[domain] : 0;
+}
+
+double hb_get_window_domain_energy(const heartbeat_t* hb, unsigned int domain) {
+  return domain < hb->ld.domain_count ? hb->ld.ed.domain_window_energy[domain] : 0;
+}
+
+double hb_get_global_domain_power(const heartbeat_t* hb, unsigned int domain) {
+  if (domain >= hb->ld.domain_count) {
+    return 0;
+  }
+  return hb_read_current_double(hb, offsetof(heartbeat_record_t, domain_global_pwr) +
+                                domain * sizeof(double));
+}
+
+double hb_get_window_domain_power(const heartbeat_t* hb, unsigned int domain) {
+  if (domain >= hb->ld.domain_count) {
+    return 0;
+  }
+  return hb_read_current_double(hb, offsetof(heartbeat_record_t, domain_window_pwr) +
+                                domain * sizeof(double));
+}
+
 double hb_get_global_power(const heartbeat_t* hb) {
-  return hb->ld.log[hb->ld.read_index].global_pwr;
+  return hb_read_current_double(hb, offsetof(heartbeat_record_t, global_pwr));
 }
 
 double hb_get_window_power(const heartbeat_t* hb) {
-  return hb->ld.log[hb->ld.read_index].window_pwr;
+  return hb_read_current_double(hb, offsetof(heartbeat_record_t, window_pwr));
 }
 
 double hb_get_instant_power(const heartbeat_t* hb) {
-  return hb->ld.log[hb->ld.read_index].instant_pwr;
+  return hb_read_current_double(hb, offsetof(heartbeat_record_t, instant_pwr));
+}
+
+double hb_get_global_energy_per_work(const heartbeat_t* hb) {
+  return hb_read_current_double(hb, offsetof(heartbeat_record_t, global_epw));
+}
+
+double hb_get_window_energy_per_work(const heartbeat_t* hb) {
+  return hb_read_current_double(hb, offsetof(heartbeat_record_t, window_epw));
+}
+
+double hb_get_instant_energy_per_work(const heartbeat_t* hb) {
+  return hb_read_current_double(hb, offsetof(heartbeat_record_t, instant_epw));
+}
+
+double hb_get_global_edp(const heartbeat_t* hb) {
+  return hb_read_current_double(hb, offsetof(heartbeat_record_t, global_edp));
+}
+
+double hb_get_window_edp(const heartbeat_t* hb) {
+  return hb_read_current_double(hb, offsetof(heartbeat_record_t, window_edp));
+}
+
+double hb_get_instant_edp(const heartbeat_t* hb) {
+  return hb_read_current_double(hb, offsetof(heartbeat_record_t, instant_edp));
 }
 
 double hbr_get_energy(const heartbeat_record_t* hbr) {
   return hbr->energy;
 }
 
+double hbr_get_domain_energy(const heartbeat_record_t* hbr, unsigned int domain) {
+  return hbr->domain_energy[domain];
+}
+
+double hbr_get_global_domain_power(const heartbeat_record_t* hbr,
+                                   unsigned int domain) {
+  return hbr->domain_global_pwr[domain];
+}
+
+double hbr_get_window_domain_power(const heartbeat_record_t* hbr,
+                                   unsigned int domain) {
+  return hbr->domain_window_pwr[domain];
+}
+
 double hbr_get_global_power(const heartbeat_record_t* hbr) {
   return hbr->global_pwr;
 }
@@ -249,4 +750,39 @@ double hbr_get_instant_power(const heartbeat_record_t* hbr) {
   return hbr->instant_pwr;
 }
 
+double hbr_get_global_energy_per_work(const heartbeat_record_t* hbr) {
+  return hbr->global_epw;
+}
+
+double hbr_get_window_energy_per_work(const heartbeat_record_t* hbr) {
+  return hbr->window_epw;
+}
+
+double hbr_get_instant_energy_per_work(const heartbeat_record_t* hbr) {
+  return hbr->instant_epw;
+}
+
+double hbr_get_global_edp(const heartbeat_record_t* hbr) {
+  return hbr->global_edp;
+}
+
+double hbr_get_window_edp(const heartbeat_record_t* hbr) {
+  return hbr->window_edp;
+}
+
+double hbr_get_instant_edp(const heartbeat_record_t* hbr) {
+  return hbr->instant_edp;
+}
+
+double hbru_get_energy(const heartbeat_rollup_t* hbru) {
+  return hbru->energy;
+}
+
+double hbru_get_power(const heartbeat_rollup_t* hbru) {
+  if (hbru->time == 0) {
+    return 0;
+  }
+  return hbru->energy / (hbru->time / 1000000000.0);
+}
+
 #endif
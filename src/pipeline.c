@@ -1,6 +1,7 @@
 /**
  *  Example of pipelined heartbeats.
  */
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,8 +30,16 @@ int main(int argc, char** argv) {
   heartbeat_t* heart_recv = heartbeat_acc_pow_init(heart, 20, 20, "heartbeat_recv.log", &get_energy, NULL);
   heartbeat_t* heart_work = heartbeat_acc_pow_init(heart, 20, 20, "heartbeat_work.log", &get_energy, NULL);
   heartbeat_t* heart_send = heartbeat_acc_pow_init(heart, 20, 20, "heartbeat_send.log", &get_energy, NULL);
+  // per-second rollups of whole iterations
+  int tier = hb_add_rollup(heart, 1000000000, 60);
   usleep(1000);
 
+  // the send stage and the iteration complete together
+  heartbeat_t* done[2] = { heart_send, heart };
+  const uint64_t done_work[2] = { 0, 1 };
+  const double done_accuracy[2] = { 0.0, 1.0 };
+  const heartbeat_t* done_prev[2] = { heart_work, NULL };
+
   for(i = 0; i < iterations; i++) {
     // receive data
     usleep(100000);
@@ -38,11 +47,17 @@ int main(int argc, char** argv) {
     // process data
     usleep(100000);
     heartbeat_acc(heart_work, i, 1, 1.0, heart_recv);
-    // send data
+    // send data and complete iteration
     usleep(100000);
-    heartbeat_acc(heart_send, i, 0, 0.0, heart_work);
-    // complete iteration
-    heartbeat_acc(heart, i, 1, 1.0, NULL);
+    heartbeat_acc_group(done, 2, i, done_work, done_accuracy, done_prev);
+  }
+
+  heartbeat_rollup_t summary;
+  if (tier >= 0 &&
+      hb_get_rollup_summary(heart, tier, 0, INT64_MAX, &summary) == 0) {
+    printf("%" PRIu64 " iterations: %.2f/s, total accuracy %.2f, %.2f W\n",
+           hbru_get_count(&summary), hbru_get_rate(&summary),
+           hbru_get_accuracy(&summary), hbru_get_power(&summary));
   }
 
   // cleanup heartbeats